@@ -0,0 +1,67 @@
+/* arena.c */
+/* bump allocator; blocks are kept for reuse when the arena is reset */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "utils.h"
+#include "arena.h"
+
+#define ALIGN 16
+
+typedef struct block {
+  struct block *next;
+  size_t size, used;
+  char *mem;
+} block;
+
+struct arena {
+  block *first, *cur;
+  size_t block_size;
+};
+
+static block *new_block(size_t size) {
+  block *b;
+  b = (block *) space(sizeof(block));
+  b->mem = (char *) space(size);
+  b->size = size;
+  return b;
+}
+
+Arena *new_arena(size_t block_size) {
+  Arena *a;
+  a = (Arena *) space(sizeof(Arena));
+  a->block_size = block_size;
+  a->first = a->cur = new_block(block_size);
+  return a;
+}
+
+void *arena_alloc(Arena *a, size_t n) {
+  void *p;
+  n = (n + ALIGN-1) & ~((size_t) ALIGN-1);
+  while (a->cur->used + n > a->cur->size) {
+    if (a->cur->next == NULL)
+      a->cur->next = new_block((n > a->block_size) ? n : a->block_size);
+    a->cur = a->cur->next;
+  }
+  p = a->cur->mem + a->cur->used;
+  a->cur->used += n;
+  return p;
+}
+
+void arena_reset(Arena *a) {
+  block *b;
+  for (b=a->first; b; b=b->next) b->used = 0;
+  a->cur = a->first;
+}
+
+void free_arena(Arena *a) {
+  block *b, *nb;
+  for (b=a->first; b; b=nb) {
+    nb = b->next;
+    free(b->mem);
+    free(b);
+  }
+  free(a);
+}
+
+/* End of file */
@@ -0,0 +1,16 @@
+/* arena.h */
+
+#ifndef _arena_h
+#define _arena_h
+
+/* memory that is handed out piecewise and released all at once */
+typedef struct arena Arena;
+
+extern Arena *new_arena(size_t block_size);
+extern void  *arena_alloc(Arena *a, size_t n);
+extern void   arena_reset(Arena *a);   /* release everything, keep blocks */
+extern void   free_arena(Arena *a);
+
+#endif
+
+/* End of file */
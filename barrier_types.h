@@ -1,4 +1,8 @@
 /* global structures */
+#ifndef _barrier_types_h
+#define _barrier_types_h
+
+#include <stdio.h>
 #include "hash_util.h"
 typedef struct {
   int father;        /* which lmin do I merge with */
@@ -34,6 +38,24 @@ typedef struct {
   int label;
   int rates;
   int microrates;
+  char *edges;       /* CSR edge file for general graphs */
+  char *plugin;      /* shared object providing the move set */
+  int generic_kernel; /* no move set specific neighbor lookup */
+  int threads;       /* threads for neighbor lookups */
+  int window;        /* structures per lookup window */
+  char *prefix;      /* prepended to output file names, or NULL */
+  char *stream;      /* file for minima as soon as they are final */
+  int progress;      /* structures between progress records in stream */
+  char *snapshot;    /* file for snapshots of the run, or NULL */
+  int snapshot_every; /* structures between snapshots, 0: only at the end */
+  char *resume;      /* snapshot to continue from, or NULL */
+  char *between;     /* "c1=c2": only find the saddle between c1, c2 */
+  int prune;         /* drop minima below minh while flooding */
+  int minima;        /* only local minima and their gradient basins */
+  int cache_edges;   /* keep the neighbors found by flooding for rates */
+  char *edge_spill;  /* ..in this file instead of memory, or NULL */
+  int ordered_rates; /* threads add up rates in input order */
+  int sparse_rates;  /* rate matrix without its zeros */
 } barrier_options;
 
 typedef struct {
@@ -41,3 +63,5 @@ typedef struct {
   char key[128];
   short num;
 } path_entry;
+
+#endif
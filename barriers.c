@@ -3,11 +3,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
 #include <limits.h>
 #include <float.h>
+#include <time.h>
 #include "ringlist.h"
 #include "stapel.h"
 #include "utils.h"
@@ -16,6 +18,20 @@
 #include "compress.h"
 #include "treeplot.h"
 #include "simple_set.h"
+#include "plugin.h"
+#include "arena.h"
+#include "moves.h"
+#include "packed_moves.h"
+#include "barriers.h"
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#if HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #if HAVE_SECIS_EXTENSION
 #include "SECIS/secis_neighbors.h"
 #endif
@@ -24,130 +40,394 @@
 static char UNUSED rcsid[] =
 "$Id: barriers.c,v 1.38 2008/01/10 14:40:01 ivo Exp $";
 
-static char *form;         /* array for configuration */
-static loc_min *lmin;      /* array for local minima */
-
-static double **rate;      /* rate matrix between basins */
-static double  *dr;        /* increments to rate matrix  */
-/* "global" variables */
-
-static int n_lmin;
-static unsigned int max_lmin;
-static int n_saddle;
-static double minh;
-static double energy;
-    /* energy of last read structure (for check_neighbors) */
-static int *POV;    /* list of last read POSET values */
-static int POV_size;
-static double mfe;           /* used for scaling Z */
-
-static void (*move_it)(char *);
-static void (*free_move_it)(void) = NULL;
-static char *(*pack_my_structure)(const char *) ;
-static char *(*unpack_my_structure)(const char *) ;
-
-static double kT= -1;
-extern unsigned long collisions;
-
-/* global switches */  /* defaults changed */
-static int print_saddles = 1;
-static int bsize = 1;
-static int shut_up = 0;
-static int verbose = 0;
-static int max_print = 0;
-static int IS_RNA = 0;
-static int print_labels = 0;
-static int IS_arbitrary = 0;
-
-static int maxlabellength = 0;
-
-/* private functions */
-static void walk_limb (hash_entry *hp, int LM, int inc, const char *tag);
-static void backtrack_path_rec (int l1, int l2, const char *tag);
-static int *make_sorted_index(int *truemin);
-static void Sorry(char *GRAPH);
-static void print_hash_entry(hash_entry *h);
-static int  read_data(barrier_options opt, double *energy,char *strucb,
-		      int len, int *POV);
-
-static void merge_components(int c1, int c2);
-static int comp_comps(const void *A, const void *B);
-
-/* public functiones */
-int      *make_truemin(loc_min *Lmin);
-loc_min  *barriers(barrier_options opt);
-
-static int  compare(const void *a, const void *b);
-void check_neighbors(void);
-static void merge_basins(void);
-void print_results(loc_min *L, int *tm, char *farbe);
-void ps_tree(loc_min *Lmin, int *truemin, int rates);
-void print_rates(int n, char *fname);
+#define HASHSIZE (((unsigned long) 1<<HASHBITS)-1)
 
+/* Connected components of equal energy form a union-find forest in
+   truecomp, by rank. While the band is flooded the basins each
+   component touches are only appended to its set; merge_basins()
+   collects them at the root and sorts them once. */
 struct comp {
   Set *basins; /* set of basins connected by these saddles */
   char *saddle; /* one representative (first found) */
   int size;
+  int rank;     /* bound on the height of the tree below */
+  int next;     /* circular list of the components merged with this */
+  int first;    /* lowest number in the list, orders equal basin sets */
 };
 
-static int *truecomp;
-static struct comp *comp;
-static int max_comp=1024, n_comp;
-static int do_rates=0;
-static int do_microrates=0;
+/* input window for parallel lookups, see flood_window() */
+typedef struct {
+  hash_entry *hp;       /* entry of the structure */
+  double energy;        /* its energy as read, hp->energy is a float */
+  char *form;           /* configuration, if the move set needs it */
+  hash_entry **hits;    /* its neighbors that come before it */
+  int nh, max_hits;
+} win_member;
+
+#define WIN_CHUNK 16    /* structures taken at a time by a thread */
+#ifndef RATE_CHUNK
+#define RATE_CHUNK 1024 /* structures taken at a time by a rate thread */
+#endif
 
-#define HASHSIZE (((unsigned long) 1<<HASHBITS)-1)
-static hash_entry *hpool;
+/* rates between the macro states 1..n: a dense matrix, or with
+   --sparse-rates the nonzero entries in an open addressing hash table
+   keyed by i*(n+1)+j. Either way every entry is summed up in the
+   same order. */
+typedef struct {
+  int n;
+  double **dense;
+  unsigned long *key;          /* 0 for empty slots */
+  double *val;
+  unsigned long size, used;    /* size is a power of 2 */
+} rate_matrix;
+
+/* where a reader is in the edges kept by --cache-edges */
+typedef struct {
+  FILE *fp;             /* own handle on the edge file, or NULL */
+  unsigned long next;   /* next edge to read */
+  unsigned int *buf;    /* edges read from fp */
+  int max_buf;
+  int failed;           /* reading fp failed */
+} edge_cursor;
+
+/* what compute_rates() needs per thread: the weight dr[gb] that the
+   current structure sends to each of the n_gb macro states in gb */
+typedef struct {
+  double *dr;
+  int *gb, n_gb;
+  int *seen;            /* seen[i]==r+1: i is in gb for structure r */
+  edge_cursor ec;
+  rate_matrix *rate;    /* sums of this thread, NULL with --ordered-rates */
+  struct rate_job *job;
+  landscape *ls;
+} rate_worker;
+
+#ifndef PRUNE_MIN
+#define PRUNE_MIN 1024  /* fewest dropped minima worth a compact_lmin() */
+#endif
+
+/* A snapshot holds the state of a run at the end of an energy band,
+   when no connected components are open: the header, graph, move set
+   and sequence (\0 separated, padded to 8 bytes), readl snap_entry,
+   readl*POV_size poset values, n_lmin snap_min (minima 1..n_lmin) and
+   the readl \0 terminated keys. Pointers are stored as indices into
+   hpool, -1 for NULL. Everything is in native byte order. */
+#define SNAP_MAGIC "BARSNAP3"
+
+typedef struct {
+  char magic[8];
+  int readl, n_lmin, n_saddle, false_lmin, POV_size;
+  int meta_len;              /* bytes of graph, move set and sequence */
+  int n_id;                  /* minima found, more than n_lmin if pruned */
+  int minima_only;           /* taken with --minima */
+  int spin_len, perm_n, tree_n; /* sizes of the keys, see set_key_dims() */
+  double energy, mfe, kT;
+  unsigned long keys_len;    /* bytes of the keys */
+} snap_header;
+
+typedef struct {
+  float energy;
+  int basin, GradientBasin, down;
+} snap_entry;
+
+typedef struct {
+  int id;                    /* number in the order found */
+  int father, uf, structure, saddle, left, right;
+  float E_saddle, energy, Z, Zg;
+  long my_GradPool, my_pool, fathers_pool;
+} snap_min;
+
+/* Everything one flooding run needs. Each barriers_open() gets its own
+   landscape, so several landscapes can be flooded one after the other
+   or concurrently from different threads. It is passed to all the
+   functions below that work on the run. */
+struct landscape {
+  barrier_options opt;
+  int failed;         /* an error stopped the run, see run_error() */
+  char *form;         /* array for configuration */
+  int length;         /* its size */
+  loc_min *lmin;      /* array for local minima */
+  int *uf;            /* union-find forest of lmin, roots are the
+			 current deepest minima of merged basins */
+
+  rate_matrix *rate;  /* rate matrix between basins */
+
+  int n_lmin;
+  unsigned int max_lmin;
+  int prune;          /* drop minima shallower than minh while flooding */
+  int *lmin_id;       /* with prune: number of lmin[i] in order found */
+  int n_id, n_pruned; /* minima found, dropped ones still in lmin */
+  int n_saddle;
+  int false_lmin;     /* merged minima shallower than minh */
+  int minima_only;    /* only gradient basins, see descend() */
+  double minh;
+  double energy;      /* energy of last read structure (for check_neighbors) */
+  double last_en;     /* to check the input is sorted */
+  int *POV;           /* list of last read POSET values */
+  int POV_size;
+  double mfe;         /* used for scaling Z */
+  int readl;          /* structures read so far */
+  int done;           /* found all we want to know */
+  double t0;          /* wall clock when flooding started, for -v */
+  unsigned long n_neighbors;  /* neighbors looked up while flooding */
+
+  void (*move_it)(char *);
+  void (*free_move_it)(void);
+  char *(*pack_my_structure)(const char *) ;
+  char *(*unpack_my_structure)(const char *) ;
+  int packed_moves;   /* move_it() takes and pushes packed keys */
+  const barriers_moveset *plugin;
+  int (*find_neighbors)(landscape *L, char *conf, char *pform);
+  move_conf *mc;      /* settings of the built in move sets */
+  char *alpha;        /* alphabet of Hamming graphs */
+  int stapel_len;     /* longest key on the neighbor stack */
+  double kT;
+
+  /* global switches */  /* defaults changed */
+  int print_saddles;
+  int bsize;
+  int shut_up;
+  int verbose;
+  int max_print;
+  int IS_RNA;
+  int print_labels;
+  int IS_arbitrary;
+  int csr_graph;      /* general graph with integer vertices */
+  int maxlabellength;
+  int do_rates;
+  int do_microrates;
+  /* --cache-edges: the neighbors flood() got for the structures from
+     edge_base on, edge_n[r-edge_base] for structure r, stored one
+     after the other as hpool indices in edge_adj or in the file
+     edge_fp, so compute_rates() needs no move set */
+  int cache_edges, edge_base, *edge_n, max_edge_n;
+  unsigned int *edge_adj;
+  unsigned long n_edges, max_edges;
+  FILE *edge_fp;
+  char *edge_name;
+
+  int *truecomp;
+  struct comp *comp;
+  int max_comp, n_comp;
+  Arena *band;        /* component sets of the current energy band */
+
+  hash_table *hash;
+  hash_entry *hpool;
+  unsigned long hpool_size;
+  unsigned long n_vertex;  /* general graphs in CSR format: */
+  hash_entry **vertex;     /* vertex number -> hash entry */
+  FILE *mergefile;
+  FILE *stream;            /* --stream: minima once they are final */
+  int progress;            /* structures between progress records */
+  char *snap_name;         /* --snapshot file, or NULL */
+  int snap_every, next_snap;  /* structures between snapshots */
+  int resumed;             /* input up to resume_en is in the snapshot */
+  double resume_en;
+  int flood_all;           /* don't stop after max_print minima */
+  /* --between: two target configurations, given packed or by their
+     position in the input */
+  int n_targets;
+  char *tgt_key[2];
+  int tgt_line[2];
+
+  int n_threads, win_size;
+  win_member *win[2];      /* window being read, window being committed */
+  int win_n[2], cur_win;
+  win_member *lookup_win;  /* window being looked up */
+  int lookup_n, lookup_next;
+#if HAVE_PTHREAD
+  pthread_t *pool;
+  pthread_mutex_t pool_lock, win_lock;
+  pthread_cond_t pool_start, pool_done;
+  int pool_round, pool_busy, pool_quit;
+#endif
+
+  path_entry *path;
+  int np, max_path;
+};
+
+/* neighbors found by find_neighbors(), per thread */
+static THREADLOCAL hash_entry **hits;
+static THREADLOCAL int max_hits=0;
+static THREADLOCAL unsigned long n_looked_up=0; /* by the last call */
+static THREADLOCAL char *batch_keys=NULL;  /* keys of a key_batch */
+static THREADLOCAL int max_batch_keys=0;
+
+/* private functions */
+static void use_moves(landscape *L);
+static int run_error(landscape *L, const char *fmt, ...);
+static int set_barrier_options(landscape *L, barrier_options opt);
+static int flood_structure(landscape *L, double new_en);
+static void free_windows(landscape *L);
+static int walk_limb(landscape *L, hash_entry *hp, int LM, int inc,
+		     const char *tag);
+static int backtrack_path_rec(landscape *L, int l1, int l2, const char *tag);
+static int Sorry(landscape *L, char *GRAPH);
+static void print_hash_entry(hash_entry *h);
+static int  read_data(landscape *L, double *en, char *strucb, int len,
+		      int *pov);
+static unsigned long vertex_id(landscape *L, const char *s);
+static hash_entry *lookup_structure(landscape *L, char *packed);
+static int generic_neighbors(landscape *L, char *conf, char *pform);
+static int csr_neighbors(landscape *L, char *conf, char *pform);
+static int spin_flip_neighbors(landscape *L, char *conf, char *pform);
+static int spin_complement_neighbors(landscape *L, char *conf, char *pform);
+static int spin_exchange_neighbors(landscape *L, char *conf, char *pform);
+static int transposition_neighbors(landscape *L, char *conf, char *pform);
+static int ctransposition_neighbors(landscape *L, char *conf, char *pform);
+static int reversal_neighbors(landscape *L, char *conf, char *pform);
+static int nni_neighbors(landscape *L, char *conf, char *pform);
+
+static int merge_components(landscape *L, int c1, int c2);
+static int find_basin(landscape *L, int b);
+static int find_comp(landscape *L, int c);
+static int comp_comps(const void *A, const void *B);
+
+static int  compare(const void *a, const void *b);
+static int check_neighbors(landscape *L);
+static void flood(landscape *L, hash_entry *me, hash_entry **hits, int nh);
+static void descend(landscape *L, hash_entry *me, hash_entry **hits, int nh);
+static int new_lmin(landscape *L, hash_entry *me, double Zi);
+static void store_edges(landscape *L, hash_entry *me, hash_entry **hits,
+			int nh);
+static int cached_neighbors(landscape *L, int r, edge_cursor *ec);
+static int threads_ok(landscape *L);
+static void free_rates(rate_matrix *m);
+static double get_rate(rate_matrix *m, int i, int j);
+static double *rate_slot(rate_matrix *m, unsigned long k);
+static unsigned long *sorted_rates(rate_matrix *m);
+static int add_to_window(landscape *L, double en);
+static int flood_window(landscape *L);
+static int start_threads(landscape *L, int n);
+static void stop_threads(landscape *L);
+static void merge_basins(landscape *L);
+static void stream_min(landscape *L, int i, double E_saddle);
+static void stream_progress(landscape *L);
+static void write_snapshot(landscape *L, int n);
+static int targets_merged(landscape *L, int n);
+static int tree_saddle(landscape *L, int l1, int l2);
+static void grow_path(landscape *L);
+static void grow_lmin(landscape *L);
+static void compact_lmin(landscape *L);
+static int load_snapshot(landscape *L, const char *name);
 
 /* ----------------------------------------------------------- */
 
-void set_barrier_options(barrier_options opt) {
-  print_saddles = opt.print_saddles;
-  bsize = opt.bsize;
-  shut_up = opt.want_quiet;
-  max_print = opt.max_print;
-  minh = opt.minh;
-  verbose = opt.want_verbose;
-  print_labels = opt.label;
-  switch(opt.GRAPH[0]) {
+/* number of minimum i in the order they were found */
+#define min_id(i) ((L->lmin_id) ? L->lmin_id[i] : (i))
+
+/* wall clock seconds */
+static double wall_time(void) {
+#if HAVE_CLOCK_GETTIME
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9*ts.tv_nsec;
+#else
+  return (double) time(NULL);
+#endif
+}
+
+/* report an error on stderr, fmt may be NULL if that has been done
+   already; the run is over, L is only good for barriers_reopen() and
+   barriers_close() after this */
+static int run_error(landscape *L, const char *fmt, ...) {
+  va_list args;
+  if (fmt) {
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+  }
+  L->failed = 1;
+  return -1;
+}
+
+/* key of RNA structure struc, NULL if it isn't one */
+static char *pack_rna(const char *struc) {
+  const char *s;
+  int depth=0;
+  for (s=struc; *s && depth>=0; s++)
+    if (*s=='(') depth++;
+    else if (*s==')') depth--;
+    else if (*s!='.') depth = -1;
+  if (depth) {
+    fprintf(stderr, "%s is not a secondary structure\n", struc);
+    return NULL;
+  }
+  return pack_structure(struc);
+}
+
+static int set_plugin_moves(landscape *L, barrier_options opt) {
+  if ((L->plugin = load_moveset_plugin(opt.plugin))==NULL)
+    return run_error(L, NULL);
+  if (L->plugin->init && L->plugin->init(opt.GRAPH, opt.MOVESET, opt.seq))
+    return run_error(L, "plugin %s failed to initialize graph %s",
+		     opt.plugin, opt.GRAPH);
+  L->free_move_it = L->plugin->cleanup;
+  L->pack_my_structure = (L->plugin->pack) ? L->plugin->pack : strdup;
+  L->unpack_my_structure = (L->plugin->unpack) ? L->plugin->unpack : strdup;
+  L->packed_moves = L->plugin->packed_moves;
+  if (L->plugin->max_degree>max_hits) {
+    max_hits = L->plugin->max_degree;
+    hits = (hash_entry **) xrealloc(hits, max_hits*sizeof(hash_entry *));
+  }
+  if (L->verbose)
+    fprintf(stderr, "Graph is %s from plugin %s\n",
+	    (L->plugin->name) ? L->plugin->name : opt.GRAPH, opt.plugin);
+  return 0;
+}
+
+static int set_barrier_options(landscape *L, barrier_options opt) {
+  L->print_saddles = opt.print_saddles;
+  L->bsize = opt.bsize;
+  L->shut_up = opt.want_quiet;
+  L->max_print = opt.max_print;
+  L->minh = opt.minh;
+  L->verbose = opt.want_verbose;
+  L->print_labels = opt.label;
+  if (opt.plugin) {
+    if (set_plugin_moves(L, opt)) return -1;
+  }
+  else switch(opt.GRAPH[0]) {
   case 'R' :    /* RNA secondary Structures */
     if (strncmp(opt.GRAPH, "RNA", 3)==0) {
       int nolp=0, shift=1, i=0;
-      IS_RNA=1;
+      L->IS_RNA=1;
       if (opt.kT<=-300) opt.kT=37;
-      kT = 0.00198717*(273.15+opt.kT);   /* kT at 37C in kcal/mol */
-      move_it = RNA_move_it;
-      free_move_it = RNA_free_rl;
-      pack_my_structure = pack_structure;
-      unpack_my_structure = unpack_structure;
+      L->kT = 0.00198717*(273.15+opt.kT);   /* kT at 37C in kcal/mol */
+      L->move_it = RNA_move_it;
+      L->free_move_it = RNA_free_rl;
+      L->pack_my_structure = pack_rna;
+      L->unpack_my_structure = unpack_structure;
       if (strstr(opt.GRAPH,   "noLP")) nolp=1;
       if (strstr(opt.MOVESET, "noShift")) shift=0;
-      else if (strlen(opt.MOVESET)) {
-	fprintf(stderr, "Unknown moveset %s\n", opt.MOVESET);
-	exit (EXIT_FAILURE);
-      }
+      else if (strlen(opt.MOVESET))
+	return run_error(L, "Unknown moveset %s", opt.MOVESET);
       for (i=0; i < (int)strlen(opt.seq); i++){
 	if (opt.seq[i] == 'T')
 	  opt.seq[i] = 'U';
       }
       RNA_init(opt.seq, shift, nolp);
-      if (verbose)
+      if (L->verbose)
 	fprintf(stderr, "Graph is RNA with noLP=%d, Shift=%d\n", nolp, shift);
-    } else Sorry(opt.GRAPH);
+    } else return Sorry(L, opt.GRAPH);
     break;
   case 'Q' :    /* Haming graphs */
     if (strcmp(opt.GRAPH,"Q2")==0) {   /* binary +- alphabet */
       if(strcmp(opt.MOVESET,"c")==0) {
-	move_it = SPIN_complement_move_it;
-	if (verbose)
+	L->move_it = SPIN_complement_move_it;
+	L->find_neighbors = spin_complement_neighbors;
+	if (L->verbose)
 	  fprintf(stderr, "Graph is Q2 with complementation moves\n");
       }
       else {
-	move_it = SPIN_move_it;
-	if (verbose) fprintf(stderr, "Graph is Q2\n");
+	L->move_it = SPIN_move_it;
+	L->find_neighbors = spin_flip_neighbors;
+	if (L->verbose) fprintf(stderr, "Graph is Q2\n");
       }
-      pack_my_structure = pack_spin;
-      unpack_my_structure = unpack_spin;
+      L->pack_my_structure = pack_spin;
+      L->unpack_my_structure = unpack_spin;
+      L->packed_moves = 1;
     }
     else {
       int alphabetsize=0;
@@ -157,204 +437,581 @@ void set_barrier_options(barrier_options opt) {
       numconv = sscanf(opt.GRAPH,"Q%d,%s",&alphabetsize,ALPHA);
       switch(numconv) {
       case 2 :
-	if((int)strlen(ALPHA)!=alphabetsize) Sorry(opt.GRAPH);
+	if((int)strlen(ALPHA)!=alphabetsize) numconv = 0;
 	break;
       case 1 :
-	if((alphabetsize<=0)||(alphabetsize>26)) Sorry(opt.GRAPH);
-	free(ALPHA);
-	ALPHA = (char *) space(sizeof(char)*(alphabetsize+1));
-	for(i=0;i<alphabetsize;i++) ALPHA[i] = (char) 65+i;
-	break;
-      default:
-	Sorry(opt.GRAPH);
+	if((alphabetsize<=0)||(alphabetsize>26)) numconv = 0;
+	else {
+	  free(ALPHA);
+	  ALPHA = (char *) space(sizeof(char)*(alphabetsize+1));
+	  for(i=0;i<alphabetsize;i++) ALPHA[i] = (char) 65+i;
+	}
 	break;
       }
+      if (numconv<1 || numconv>2) {
+	free(ALPHA);
+	return Sorry(L, opt.GRAPH);
+      }
       String_set_alpha(ALPHA);
+      L->alpha = ALPHA;
       if(strcmp(opt.MOVESET,"c")==0){
 	initialize_crankshaft();
-	move_it = String_move_it_crankshaft;
-	if(verbose)
+	L->move_it = String_move_it_crankshaft;
+	if(L->verbose)
 	  fprintf(stderr, "Graph is Q%d with Alphabet '%s' with crankshaft moves\n",
 		  alphabetsize,ALPHA);
       }
       else{
-	move_it = String_move_it;
-	if(verbose)
+	L->move_it = String_move_it;
+	if(L->verbose)
 	  fprintf(stderr, "Graph is Q%d with Alphabet '%s'\n",
 		  alphabetsize,ALPHA);
       }
       if(alphabetsize < 7){
 	ini_pack_em(opt);
-	pack_my_structure = pack_em;
-	unpack_my_structure = unpack_em;
+	L->pack_my_structure = pack_em;
+	L->unpack_my_structure = unpack_em;
       }
       else {
-	pack_my_structure = strdup;
-	unpack_my_structure = strdup;
+	L->pack_my_structure = strdup;
+	L->unpack_my_structure = strdup;
       }
     }
     break;
   case 'P' :    /* Permutations */
     switch(*opt.MOVESET) {
     case 'R' :
-      move_it = Reversal_move_it; break;
+      L->move_it = Reversal_move_it;
+      L->find_neighbors = reversal_neighbors;
+      break;
     case 'C' :
-      move_it = CTranspos_move_it; break;
+      L->move_it = CTranspos_move_it;
+      L->find_neighbors = ctransposition_neighbors;
+      break;
     case 'T':
     default:
 
-      move_it = Transpos_move_it;
+      L->move_it = Transpos_move_it;
+      L->find_neighbors = transposition_neighbors;
     }
-    pack_my_structure = strdup;
-    unpack_my_structure = strdup;
-    if (verbose)
+    L->pack_my_structure = pack_perm;
+    L->unpack_my_structure = unpack_perm;
+    L->packed_moves = 1;
+    if (L->verbose)
       fprintf(stderr, "Graph is Permutations with moveset %c\n",
 	      *opt.MOVESET ? *opt.MOVESET : 'T');
     break;
   case 'S':     /* multi objective SECIS design */
 #if HAVE_SECIS_EXTENSION
-    move_it = SECIS_move_it;
-    pack_my_structure = strdup;
-    unpack_my_structure = strdup;
+    L->move_it = SECIS_move_it;
+    L->pack_my_structure = strdup;
+    L->unpack_my_structure = strdup;
 #else
-    fprintf(stderr,
-	    "You need to reconfigure barriers with the --with-secis"
-	    " option\nto use barriers SECIS design extension\n");
-    exit(EXIT_FAILURE);
+    return run_error(L, "You need to reconfigure barriers with the"
+		     " --with-secis option\nto use barriers SECIS design"
+		     " extension");
 #endif
     break;
   case 'T' :    /* Phylogenetic Trees */
-    move_it = NNI_move_it;
-    pack_my_structure = strdup;
-    unpack_my_structure = strdup;
-    if (verbose)
+    L->move_it = NNI_move_it;
+    L->find_neighbors = nni_neighbors;
+    L->pack_my_structure = pack_tree;
+    L->unpack_my_structure = unpack_tree;
+    L->packed_moves = 1;
+    if (L->verbose)
       fprintf(stderr, "Graph is Trees with NNI moves\n");
     break;
   case 'X' : /* Johnson graph J(n,n/2) = balanced +/- with exchange moves */
-    move_it = EXCH_move_it;
-    pack_my_structure = pack_spin;
-    unpack_my_structure = unpack_spin;
+    L->move_it = EXCH_move_it;
+    L->find_neighbors = spin_exchange_neighbors;
+    L->pack_my_structure = pack_spin;
+    L->unpack_my_structure = unpack_spin;
+    L->packed_moves = 1;
     break;
   case '?' : /* General graph; adjacency list on file */
-    move_it = LIST_move_it;
-    pack_my_structure = strdup;
-    unpack_my_structure = strdup;
-    IS_arbitrary = 1;
+    L->move_it = LIST_move_it;
+    L->pack_my_structure = strdup;
+    L->unpack_my_structure = strdup;
+    L->IS_arbitrary = 1;
+    if (opt.edges) {   /* integer vertices, CSR edge file */
+      if ((L->n_vertex = CSR_read(opt.edges))==0)
+	return run_error(L, NULL);
+      L->vertex = (hash_entry **) space(L->n_vertex*sizeof(hash_entry *));
+      L->free_move_it = CSR_free;
+      L->csr_graph = 1;
+      if (L->verbose)
+	fprintf(stderr, "Graph has %lu vertices from edge file %s\n",
+		L->n_vertex, opt.edges);
+    }
     break;
   default :
-    Sorry(opt.GRAPH);
+    return Sorry(L, opt.GRAPH);
   }
-  if (kT<0) {
-    if (opt.kT<=-300) kT=1;
-    else kT=opt.kT;
+  /* the kernels above, or the function pointers for all other graphs */
+  if (L->csr_graph) L->find_neighbors = csr_neighbors;
+  else if (L->find_neighbors==NULL || opt.generic_kernel)
+    L->find_neighbors = generic_neighbors;
+  if (L->kT<0) {
+    if (opt.kT<=-300) L->kT=1;
+    else L->kT=opt.kT;
   }
-  do_rates = opt.rates;
+  L->do_rates = opt.rates;
   if(opt.microrates){
-    do_microrates = opt.microrates;
-    do_rates = opt.microrates;
+    L->do_microrates = opt.microrates;
+    L->do_rates = opt.microrates;
   }
+  return 0;
 }
 
-static void Sorry(char *GRAPH) {
-  fprintf(stderr,"Graph \"%s\" is not implemented\n",GRAPH);
-  exit(-2);
+static int Sorry(landscape *L, char *GRAPH) {
+  return run_error(L, "Graph \"%s\" is not implemented", GRAPH);
 }
 
-static FILE *mergefile=NULL;
-static int readl=0;
-loc_min *barriers(barrier_options opt) {
-  int length;
-  double new_en=0;
+/* name of output file name, in batch mode prefixed with the input; a
+   name with a directory gets the prefix in front of its last part, so
+   that "dir/f" becomes "dir/<input>.f" */
+static char *out_name(landscape *L, const char *name) {
+  const char *p="", *base=name;
+  char *s;
+  if (L->opt.prefix) {
+    p = L->opt.prefix;
+    if ((s = strrchr(name, '/'))) {
+      base = s+1;
+      if ((s = strrchr(p, '/'))) p = s+1;
+    }
+  }
+  s = (char *) space((base-name)+strlen(p)+strlen(base)+1);
+  memcpy(s, name, base-name);
+  strcat(strcat(s, p), base);
+  return s;
+}
+
+/* let the built in move sets and the neighbor stack of the calling
+   thread work for L, done on every entry from outside */
+static void use_moves(landscape *L) {
+  use_move_conf(L->mc);
+  ini_stapel(L->stapel_len);
+}
+
+/* --between c1=c2: remember the two targets, "@n" is the n-th
+   structure of the input */
+static int set_targets(landscape *L, const char *between) {
+  char *s, *eq;
+  const char *err=NULL;
+  int k;
+  if ((eq = strchr(between, '='))==NULL)
+    return run_error(L, "give the targets as --between <conf1>=<conf2>");
+  s = strdup(between);
+  eq = s + (eq-between);
+  *eq = '\0';
+  for (k=0; k<2 && !err; k++) {
+    char *c = (k) ? eq+1 : s;
+    if (*c=='@') {
+      if ((L->tgt_line[k] = atoi(c+1))<=0)
+	err = "--between: bad line number";
+    }
+    else if (strlen(c)>(size_t) L->length)
+      err = "--between: configuration too long";
+    else if ((L->tgt_key[k] = L->pack_my_structure(c))==NULL)
+      err = "--between: bad configuration";
+  }
+  free(s);
+  if (err) return run_error(L, "%s", err);
+  L->n_targets = 2;
+  return 0;
+}
 
-  hpool = (hash_entry *) space((HASHSIZE+1)*sizeof(hash_entry));
-  set_barrier_options(opt);
+/* set up a flooding run for opt on L, returns -1 on errors; the tables
+   of an earlier run, cleared by end_run(), are reused */
+static int start_run(landscape *L, barrier_options opt) {
+  landscape keep;
+  unsigned long size;
+
+  keep = *L;
+  memset(L, 0, sizeof(landscape));
+  L->hash = keep.hash;
+  L->hpool = keep.hpool; L->hpool_size = keep.hpool_size;
+  L->lmin = keep.lmin; L->uf = keep.uf; L->max_lmin = keep.max_lmin;
+  L->comp = keep.comp; L->truecomp = keep.truecomp;
+  L->max_comp = keep.max_comp;
+  L->band = keep.band;
+
+  L->opt = opt;
+  L->kT = -1;
+  L->print_saddles = 1;
+  L->bsize = 1;
+  L->n_threads = 1;
+  L->mc = new_move_conf();
+  use_move_conf(L->mc);
+
+  if (set_barrier_options(L, opt)) return -1;
+  /* without hashing we need at most one entry per vertex */
+  if (!L->csr_graph && !L->hash) L->hash = new_hash();
+  size = (L->csr_graph) ? L->n_vertex : HASHSIZE+1;
+  if (size>L->hpool_size) {
+    free(L->hpool);
+    L->hpool = (hash_entry *) space(size*sizeof(hash_entry));
+    L->hpool_size = size;
+  }
 
-  length = (int) strlen(opt.seq);
-  max_lmin = 16383;
-  lmin = (loc_min *) space((max_lmin + 1) * sizeof(loc_min));
-  n_lmin = 0;
+  L->length = (int) strlen(opt.seq);
+  if (L->lmin==NULL) {
+    L->max_lmin = 16383;
+    L->lmin = (loc_min *) space((L->max_lmin + 1) * sizeof(loc_min));
+    L->uf = (int *) space((L->max_lmin + 1) * sizeof(int));
+  }
+  L->n_lmin = 0;
+  if (opt.prune) {
+    if (L->bsize || L->do_rates || opt.between)
+      fprintf(stderr, "--prune ignored, --bsize, --rates and --between "
+	      "need all local minima\n");
+    else {
+      L->prune = 1;
+      L->lmin_id = (int *) space((L->max_lmin + 1) * sizeof(int));
+    }
+  }
 
-  form = (char *) space((length+1)*sizeof(char));
-  comp = (struct comp *) space((max_comp+1) * sizeof(struct comp));
-  truecomp = (int *) space((max_comp+1) * sizeof(int));
+  L->form = (char *) space((L->length+1)*sizeof(char));
+  if (L->comp==NULL) {
+    L->max_comp = 1024;
+    L->comp = (struct comp *) space((L->max_comp+1) * sizeof(struct comp));
+    L->truecomp = (int *) space((L->max_comp+1) * sizeof(int));
+    L->band = new_arena(1<<16);
+  }
   if(opt.poset) {
-    POV_size = opt.poset;
-    POV  = (int *) space(sizeof(int)*opt.poset);
+    L->POV_size = opt.poset;
+    L->POV  = (int *) space(sizeof(int)*opt.poset);
   }
-  else POV = NULL;
-  ini_stapel(length);
+  else L->POV = NULL;
+  /* neighbors are copied to the stack, make room for plugin keys */
+  L->stapel_len = (L->plugin && L->plugin->key_length>L->length) ?
+    L->plugin->key_length : L->length;
+  ini_stapel(L->stapel_len);
   if (opt.ssize) {
-    mergefile = fopen("saddles.txt", "w");
-    if (!mergefile) fprintf(stderr, "can't open saddle file\n");
+    char *name = out_name(L, "saddles.txt");
+    L->mergefile = fopen(name, "w");
+    if (!L->mergefile) fprintf(stderr, "can't open saddle file\n");
+    free(name);
+  }
+  if (opt.stream) {
+    char *name = out_name(L, opt.stream);
+    L->stream = fopen(name, "w");
+    if (!L->stream) fprintf(stderr, "can't open stream file %s\n", name);
+    free(name);
+    L->progress = opt.progress;
+  }
+  if (opt.snapshot) {
+    L->snap_name = out_name(L, opt.snapshot);
+    L->snap_every = L->next_snap = opt.snapshot_every;
+  }
+  if (opt.between && set_targets(L, opt.between)) return -1;
+  L->minima_only = opt.minima;
+  L->flood_all = (opt.snapshot || opt.between || opt.minima);
+  if (opt.resume) {
+    char *name = out_name(L, opt.resume);
+    int bad = load_snapshot(L, name);
+    free(name);
+    if (bad) return -1;
+    L->next_snap += L->readl;
+  }
+  if (opt.cache_edges && L->do_rates) {
+    /* a resumed run has no edges of the structures in the snapshot */
+    L->cache_edges = 1;
+    L->edge_base = L->readl;
+    if (opt.edge_spill) {
+      L->edge_name = out_name(L, opt.edge_spill);
+      L->edge_fp = fopen(L->edge_name, "w+b");
+      if (!L->edge_fp) {
+	fprintf(stderr, "can't open edge file %s, keeping edges in memory\n",
+		L->edge_name);
+	free(L->edge_name); L->edge_name = NULL;
+      }
+    }
   }
 
-  while (read_data(opt, &new_en,form,length,POV)) {
-    if (readl==0) mfe=energy=new_en;
-    if (new_en<energy)
-      nrerror("unsorted list!\n");
-    if (new_en>energy) {
-      /* new energy band started */
-      merge_basins();
-      /* fprintf(stderr, "%d %d\n", readl, lmin[1].my_pool); */
-      n_comp=0;
+  if (opt.threads>1) {
+    if (!threads_ok(L))
+      fprintf(stderr, "can't use threads for graph %s\n", opt.GRAPH);
+    else {
+      L->win_size = (opt.window>0) ? opt.window : 1;
+      L->win[0] = (win_member *) space(L->win_size*sizeof(win_member));
+      L->win[1] = (win_member *) space(L->win_size*sizeof(win_member));
+      if (start_threads(L, opt.threads)) return -1;
     }
-    energy = new_en;
-    readl++;
-    move_it(form);       /* generate all neighbor of configuration */
-    check_neighbors();   /* flood the energy landscape */
-    reset_stapel();
-    if (n_saddle+1 == max_print)
-      break;  /* we've found all we want to know */
-  }
-  switch(opt.GRAPH[0]) {
+  }
+
+  L->t0 = wall_time();
+  return 0;
+}
+
+/* can the move set be used by several threads at a time? */
+static int threads_ok(landscape *L) {
+  return !(L->plugin || (L->IS_arbitrary && !L->csr_graph) ||
+	   L->opt.GRAPH[0]=='S');
+}
+
+/* free what the current run built up, leaving the hash table, hpool,
+   lmin and component arrays empty for the next one */
+static void end_run(landscape *L) {
+  int r;
+
+  stop_threads(L);
+  free_windows(L);
+  if (L->free_move_it)
+    L->free_move_it();
+  /* clear the slots before the keys they point to are freed */
+  if (L->hash && !L->csr_graph) clear_hash(L->hash, L->hpool, L->readl);
+  for (r=0; r<L->readl; r++) {
+    free(L->hpool[r].structure);
+    free(L->hpool[r].POV);
+  }
+  /* a run that failed to start may have no tables yet */
+  if (L->readl) memset(L->hpool, 0, L->readl*sizeof(hash_entry));
+  if (L->lmin) memset(L->lmin, 0, (L->n_lmin+1)*sizeof(loc_min));
+  if (L->band) arena_reset(L->band);
+  free(L->vertex);
+  free(L->POV);
+  free(L->form);
+  free_rates(L->rate);
+  L->rate = NULL;
+  if (L->mergefile) fclose(L->mergefile);
+  if (L->stream) fclose(L->stream);
+  free(L->snap_name);
+  free(L->lmin_id);
+  free(L->edge_n);
+  free(L->edge_adj);
+  if (L->edge_fp) {
+    fclose(L->edge_fp);
+    remove(L->edge_name);
+  }
+  free(L->edge_name);
+  free(L->tgt_key[0]);
+  free(L->tgt_key[1]);
+  free(L->alpha);
+  free_move_conf(L->mc);
+}
+
+/* set up the flooding of the graph described by opt, the structures
+   are then given by barriers_read() or barriers_feed(); returns NULL
+   if that fails */
+landscape *barriers_open(barrier_options opt) {
+  landscape *L;
+  L = (landscape *) space(sizeof(landscape));
+  if (start_run(L, opt)) {
+    barriers_close(L);
+    return NULL;
+  }
+  return L;
+}
+
+/* like barriers_open(), but recycles L: its tables are cleared and
+   reused instead of being allocated again. The minima returned by the
+   previous barriers_finish() become invalid. If it fails, L is closed
+   and NULL returned. */
+landscape *barriers_reopen(landscape *L, barrier_options opt) {
+  use_moves(L);
+  end_run(L);
+  if (start_run(L, opt)) {
+    barriers_close(L);
+    return NULL;
+  }
+  return L;
+}
+
+/* flood the next structure, it has been read into L->form and L->POV;
+   returns 1 once we've found all we want to know, -1 on errors */
+static int flood_structure(landscape *L, double new_en) {
+  if (L->resumed && new_en<=L->resume_en)
+    return 0;   /* flooded before the snapshot */
+  if (L->readl==0) L->mfe=L->energy=L->last_en=new_en;
+  if (new_en<L->last_en)
+    return run_error(L, "unsorted list!");
+  if (L->csr_graph) {
+    unsigned long v = vertex_id(L, L->form);
+    if (v==L->n_vertex)
+      return run_error(L, "invalid vertex %s (graph has %lu vertices)",
+		       L->form, L->n_vertex);
+    if (L->vertex[v]) return run_error(L, "duplicate structure");
+  }
+  L->last_en = new_en;
+  if (L->stream && L->progress && L->readl && L->readl%L->progress==0)
+    stream_progress(L);
+  if (L->n_threads>1) {
+    L->readl++;
+    if (add_to_window(L, new_en)) return -1;
+    return (L->win_n[L->cur_win]==L->win_size) ? flood_window(L) : 0;
+  }
+  if (new_en>L->energy) {
+    /* new energy band started */
+    merge_basins(L);
+    /* fprintf(stderr, "%d %d\n", readl, lmin[1].my_pool); */
+    L->n_comp=0;
+    if (L->snap_every && L->readl>=L->next_snap) write_snapshot(L, L->readl);
+    if (L->n_targets && targets_merged(L, L->readl))
+      return 1;
+  }
+  L->energy = new_en;
+  L->readl++;
+  if (check_neighbors(L)) return -1;   /* flood the energy landscape */
+  if (L->failed) return -1;
+  return (L->n_saddle+1 == L->max_print && !L->flood_all);
+}
+
+/* flood the structures of opt.INFILE, returns 1 if we stopped early,
+   -1 on errors */
+int barriers_read(landscape *L) {
+  double new_en=0;
+
+  if (L->failed) return -1;
+  use_moves(L);
+  while (!L->done && read_data(L, &new_en, L->form, L->length, L->POV)>0)
+    L->done = flood_structure(L, new_en);
+  return (L->failed) ? -1 : L->done;
+}
+
+/* flood configuration conf (as it would appear in the input) of energy
+   en, pov are its poset values; structures must come in order of
+   increasing energy. Returns 1 once the remaining structures are of no
+   interest, further calls are then ignored, and -1 on errors. */
+int barriers_feed(landscape *L, const char *conf, double en, const int *pov) {
+  int l;
+
+  if (L->failed) return -1;
+  use_moves(L);
+  if (L->done) return 1;
+  l = strlen(conf);
+  if (l>L->length)
+    return run_error(L, "barriers_feed: configuration too long");
+  if (L->IS_arbitrary) {
+    if (!L->csr_graph)
+      return run_error(L, "barriers_feed: adjacency lists need "
+		       "barriers_read()");
+    if (l>L->maxlabellength) L->maxlabellength=l;
+  }
+  strcpy(L->form, conf);
+  if (L->POV_size) memcpy(L->POV, pov, L->POV_size*sizeof(int));
+  L->done = flood_structure(L, en);
+  return (L->failed) ? -1 : L->done;
+}
+
+static void free_windows(landscape *L) {
+  int i, k;
+  if (L->win[0]==NULL) return;
+  for (k=0; k<2; k++) {
+    for (i=0; i<L->win_n[k]; i++) free(L->win[k][i].form);
+    for (i=0; i<L->win_size; i++) free(L->win[k][i].hits);
+    free(L->win[k]);
+    L->win[k] = NULL;
+  }
+}
+
+/* merge the last energy band, returns the local minima; lmin[0]
+   holds their number in fathers_pool. Returns NULL on errors. */
+loc_min *barriers_finish(landscape *L) {
+  if (L->failed) return NULL;
+  use_moves(L);
+  if (L->n_threads>1) {
+    while (L->win_n[0] || L->win_n[1])
+      flood_window(L);
+    stop_threads(L);
+    if (L->failed) return NULL;
+  }
+  switch(L->opt.GRAPH[0]) {
   case 'Q':
-    if (strcmp(opt.MOVESET,"c")==0)
+    if (strcmp(L->opt.MOVESET,"c")==0)
       Q_mem_cleanup();
     break;
   default:
     break;
   }
-  merge_basins();
-  if (mergefile) fclose(mergefile);
-  if(!shut_up) fprintf(stderr,
+  merge_basins(L);
+  free_windows(L);
+  if (L->snap_name && L->readl) write_snapshot(L, L->readl);
+  if (L->verbose) {
+    double t = wall_time()-L->t0;
+    fprintf(stderr, "flooding: %lu neighbors in %.2fs, %.1f ns per neighbor\n",
+	    L->n_neighbors, t, (L->n_neighbors) ? 1e9*t/L->n_neighbors : 0.);
+  }
+  if (L->mergefile) fclose(L->mergefile);
+  L->mergefile = NULL;
+  if (L->stream) {
+    int i;
+    /* minima that never merged, as make_truemin() sees them */
+    for (i=1; i<=L->n_lmin && !L->minima_only; i++)
+      if (L->lmin[i].father==0) stream_min(L, i, L->energy + 0.000001);
+    stream_progress(L);
+    fclose(L->stream);
+    L->stream = NULL;
+  }
+  if(!L->shut_up) fprintf(stderr,
 		       "read %d structures, to find %d saddles\n",
-		       readl, n_saddle);
+		       L->readl, L->n_saddle);
 
-  if (max_print == 0 || max_print > n_lmin)
-    max_print = n_lmin;
+  if (L->max_print == 0 || L->max_print > L->n_lmin)
+    L->max_print = L->n_lmin;
 
-  lmin[0].fathers_pool = n_lmin;   /* store size here; pfs 03 2001 */
-  lmin[0].E_saddle = energy + 0.001;
-  lmin[0].energy = lmin[1].energy;
+  L->lmin[0].fathers_pool = L->n_lmin;   /* store size here; pfs 03 2001 */
+  L->lmin[0].E_saddle = L->energy + 0.001;
+  L->lmin[0].energy = L->lmin[1].energy;
 
-  if (!do_rates) {
-    if (free_move_it)
-      free_move_it();
-    free_stapel();
-  }
-  free(form);
+  free(L->form); L->form = NULL;
   fflush(stdout);
-  if(!shut_up) fprintf(stderr, "%lu hash table collisions\n", collisions);
-  free(truecomp);
-  free(comp);
-  return lmin;
+  if(!L->shut_up) fprintf(stderr, "%lu hash table collisions\n",
+			  (L->hash) ? L->hash->collisions : 0);
+  return L->lmin;
 }
 
-int *make_truemin(loc_min *Lmin) {
+/* free L with all its structures and local minima */
+void barriers_close(landscape *L) {
+  use_moves(L);
+  end_run(L);
+  if (L->hash) free_hash(L->hash);
+  free(L->hpool);
+  free(L->lmin);
+  free(L->uf);
+  free(L->truecomp);
+  free(L->comp);
+  if (L->band) free_arena(L->band);
+  /* work buffers of this thread */
+  free_stapel();
+  free(hits); hits = NULL; max_hits = 0;
+  free(batch_keys); batch_keys = NULL; max_batch_keys = 0;
+  free_move_buffers();
+  RNA_free_thread();
+  free(L);
+}
+
+int *make_truemin(landscape *L, loc_min *Lmin) {
   int *truemin, nlmin, i,ii;
+  use_moves(L);
   nlmin = Lmin[0].fathers_pool;
   truemin = (int *) space((nlmin+1)*sizeof(int));
   /* truemin[0] = nlmin; */
 
-  for (ii=i=1; (i<=max_print)&&(ii<=n_lmin); ii++) {
+  if (L->minima_only) {
+    /* no barriers, all roots are minima. Like the minima with barrier
+       0 below, those joined to a root by a plateau add their Zg to it;
+       a plateau joined to a lower basin is dropped. */
+    for (ii=i=1; (i<=L->max_print)&&(ii<=L->n_lmin); ii++) {
+      int r = find_basin(L, ii);
+      if (r==ii) truemin[ii]=i++;
+      else if (fabs(L->lmin[r].energy - L->lmin[ii].energy) <=
+	       FLT_EPSILON*fabs(L->lmin[ii].energy))
+	L->lmin[r].Zg += L->lmin[ii].Zg;
+    }
+    truemin[0] = i-1;
+    return truemin;
+  }
+
+  for (ii=i=1; (i<=L->max_print)&&(ii<=L->n_lmin); ii++) {
     int f;
-    f = lmin[ii].father;
-    if (!f) lmin[ii].E_saddle = energy + 0.000001;
-    if (lmin[ii].E_saddle - lmin[ii].energy >= minh)
+    f = L->lmin[ii].father;
+    if (!f) L->lmin[ii].E_saddle = L->energy + 0.000001;
+    if (L->lmin[ii].E_saddle - L->lmin[ii].energy >= L->minh)
       truemin[ii]=i++;
     else { /* ii is not a truemin */
-      lmin[f].Z += lmin[ii].Z;
-      lmin[f].Zg += lmin[ii].Zg;
+      L->lmin[f].Z += L->lmin[ii].Z;
+      L->lmin[f].Zg += L->lmin[ii].Zg;
     }
   }
   truemin[0] = i-1;
@@ -363,39 +1020,41 @@ int *make_truemin(loc_min *Lmin) {
 
 /*=============================================================*/
 
-static int read_data(barrier_options opt, double *energy, char *strucb,
-		     int len, int *POV){
-  int   r,l;
+/* read the next structure into strucb, returns 0 at the end of the
+   input and -1 on errors */
+static int read_data(landscape *L, double *en, char *strucb, int len,
+		     int *pov){
+  int   l;
   char *line;
-  char *token;
+  char *token, *save;
 #ifdef _DEBUG_POSET_
   static count = 1;
 #endif
 
-  line = get_line(opt.INFILE);
+  line = get_line(L->opt.INFILE);
 
   if(line==NULL) return 0;
   if(strlen(line)==0) return 0;
 
-  token=strtok(line," \t");
+  token=strtok_r(line," \t",&save);
   if(token==NULL) return 0;
   l = strlen(token);
   if(l<1) return 0;
+  if(l>len) {
+    fprintf(stderr,"read_data():\n%s\n label too long !!\n", token);
+    free(line);
+    return run_error(L, NULL);
+  }
   strcpy(strucb,token);
 
-  token = strtok(NULL," \t");
-  if(token==NULL) { fprintf(stderr, "Error in input file\n"); exit(123); }
-  r=sscanf(token,"%lf",energy);
-  if(r<1) { fprintf(stderr, "Error in input file\n"); exit(124); }
-
-  if(IS_arbitrary) {
-    /* record the maximal length of token name for output formatting */
-    if(l>maxlabellength) maxlabellength=l;
-    if(l>len) {
-      fprintf(stderr,"read_data():\n%s\n label too long !!\n", strucb);
-      exit (111);
-    }
+  token = strtok_r(NULL," \t",&save);
+  if(token==NULL || sscanf(token,"%lf",en)<1) {
+    free(line);
+    return run_error(L, "Error in input file");
   }
+
+  /* record the maximal length of token name for output formatting */
+  if(L->IS_arbitrary && l>L->maxlabellength) L->maxlabellength=l;
 #if 0
   /*
    * removed because in the lattice protein case, the sequence is one
@@ -409,22 +1068,23 @@ static int read_data(barrier_options opt, double *energy, char *strucb,
   }
 #endif
 
-  if(opt.poset) {
+  if(L->opt.poset) {
     int i,x;
-    for(i=0;i<opt.poset;i++) {
-      token = strtok(NULL," \t");
-      if(token==NULL) { fprintf(stderr, "Error in input file\n"); exit(125); }
-      r = sscanf(token,"%d",&x);
-      if(r!=1) { fprintf(stderr, "Error in input file\n"); exit(126); }
-      POV[i]=x;
+    for(i=0;i<L->opt.poset;i++) {
+      token = strtok_r(NULL," \t",&save);
+      if(token==NULL || sscanf(token,"%d",&x)!=1) {
+	free(line);
+	return run_error(L, "Error in input file");
+      }
+      pov[i]=x;
     }
 #ifdef _DEBUG_POSET_
     {
       int i;
       fprintf(stderr,"POV[%4d] = {", count);
-      for(i=0;i<opt.poset;i++) {
-	fprintf(stderr,"%2d", POV[i]);
-	if (i<opt.poset-1) fprintf(stderr,",");
+      for(i=0;i<L->opt.poset;i++) {
+	fprintf(stderr,"%2d", pov[i]);
+	if (i<L->opt.poset-1) fprintf(stderr,",");
       }
       fprintf(stderr, "}\n");
     }
@@ -432,8 +1092,8 @@ static int read_data(barrier_options opt, double *energy, char *strucb,
 #endif
   }
 
-  if(IS_arbitrary) {
-    token = strtok(NULL," \t");
+  if(L->IS_arbitrary && !L->csr_graph) {
+    token = strtok_r(NULL," \t",&save);
     if(token==NULL) put_ADJLIST(":");
     else put_ADJLIST(token);
   }
@@ -455,12 +1115,431 @@ static int compare(const void *a, const void *b) {
 
 
 /*======================*/
-void check_neighbors(void)
+/* number of vertex s, n_vertex if s isn't one */
+static unsigned long vertex_id(landscape *L, const char *s) {
+  char *end;
+  unsigned long v;
+  v = strtoul(s, &end, 10);
+  if (end==s || *end || v>=L->n_vertex) return L->n_vertex;
+  return v;
+}
+
+static hash_entry *lookup_structure(landscape *L, char *packed) {
+  hash_entry h;
+  if (L->csr_graph) {
+    unsigned long v = vertex_id(L, packed);
+    return (v<L->n_vertex) ? L->vertex[v] : NULL;
+  }
+  h.structure = packed;
+  return lookup_hash(L->hash, &h);
+}
+
+/* returns nonzero if hp is there already, or isn't a vertex */
+static int store_structure(landscape *L, hash_entry *hp) {
+  unsigned long v;
+  if (!L->csr_graph) return write_hash(L->hash, hp);
+  v = vertex_id(L, hp->structure);
+  if (v==L->n_vertex || L->vertex[v]) return 1;
+  L->vertex[v] = hp;
+  return 0;
+}
+
+#define ADD_HIT(hp) {						\
+    if (nh==max_hits) {							\
+      max_hits = 2*max_hits+64;						\
+      hits = (hash_entry **) xrealloc(hits, max_hits*sizeof(hash_entry *)); \
+    }									\
+    hits[nh++] = (hp);							\
+  }
+
+#define LOOKUP_BATCH 32  /* neighbors looked up at a time */
+
+/* look up the nb neighbor keys in kb, adding the known ones to hits;
+   owned keys are freed */
+static int lookup_batch(landscape *L, hash_entry *kb, int nb, int nh,
+			int owned) {
+  void *key[LOOKUP_BATCH], *found[LOOKUP_BATCH];
+  int i;
+  for (i=0; i<nb; i++) key[i] = kb+i;
+  lookup_hash_batch(L->hash, key, found, nb);
+  for (i=0; i<nb; i++) {
+    if (found[i]) ADD_HIT((hash_entry *) found[i]);
+    if (owned) free(kb[i].structure);
+  }
+  n_looked_up += nb;
+  return nh;
+}
+
+/* collect the already known neighbors of configuration conf (packed
+   pform) in hits[], last generated by the move set first */
+static int generic_neighbors(landscape *L, char *conf, char *pform) {
+  char *p;
+  int nh=0, nb=0;
+  hash_entry kb[LOOKUP_BATCH];
+
+  n_looked_up = 0;
+  if (L->plugin) L->plugin->neighbors(L->packed_moves ? pform : conf, push);
+  else L->move_it(L->packed_moves ? pform : conf);
+  while ((p = pop())) {
+    kb[nb].structure = (L->packed_moves) ? p : L->pack_my_structure(p);
+    if (kb[nb].structure==NULL) continue;  /* not a configuration */
+    nb++;
+    if (nb==LOOKUP_BATCH) {
+      nh = lookup_batch(L, kb, nb, nh, !L->packed_moves);
+      nb = 0;
+    }
+  }
+  nh = lookup_batch(L, kb, nb, nh, !L->packed_moves);
+  reset_stapel();
+  return nh;
+}
+
+/* Lookup kernels of the move sets in packed_moves.h, one per move set
+   with the move set and batch_key() inlined. The neighbor keys go from
+   the move set's work key to the batch instead of through the stapel;
+   they all have the length of pform. */
+typedef struct {
+  landscape *L;
+  int nh, nb, len;     /* hits, keys in kb, bytes per key */
+  hash_entry kb[LOOKUP_BATCH];
+} key_batch;
+
+static void batch_begin(landscape *L, key_batch *b, const char *pform) {
+  b->L = L;
+  b->nh = b->nb = 0;
+  n_looked_up = 0;
+  b->len = strlen(pform)+1;
+  if (LOOKUP_BATCH*b->len>max_batch_keys) {
+    max_batch_keys = LOOKUP_BATCH*b->len;
+    batch_keys = (char *) xrealloc(batch_keys, max_batch_keys);
+  }
+}
+
+static inline void batch_key(void *ctx, const char *key) {
+  key_batch *b = (key_batch *) ctx;
+  char *k = batch_keys + b->nb*b->len;
+  memcpy(k, key, b->len);
+  b->kb[b->nb++].structure = k;
+  if (b->nb==LOOKUP_BATCH) {
+    b->nh = lookup_batch(b->L, b->kb, b->nb, b->nh, 0);
+    b->nb = 0;
+  }
+}
+
+/* the hits, in the order generic_neighbors() finds them */
+static int batch_end(key_batch *b) {
+  hash_entry *t;
+  int i, nh;
+  nh = b->nh = lookup_batch(b->L, b->kb, b->nb, b->nh, 0);
+  for (i=0; i<nh/2; i++) {
+    t = hits[i]; hits[i] = hits[nh-1-i]; hits[nh-1-i] = t;
+  }
+  return nh;
+}
+
+#define PACKED_KERNEL(NAME, START, MOVES)				\
+  static int NAME(landscape *L, char *conf, char *pform) {		\
+    key_batch b;							\
+    batch_begin(L, &b, pform);						\
+    MOVES(START(pform), batch_key, &b);					\
+    return batch_end(&b);						\
+  }
+
+PACKED_KERNEL(spin_flip_neighbors, spin_start, spin_flip_moves)
+PACKED_KERNEL(spin_complement_neighbors, spin_start, spin_complement_moves)
+PACKED_KERNEL(spin_exchange_neighbors, spin_start, spin_exchange_moves)
+PACKED_KERNEL(transposition_neighbors, perm_start, perm_transposition_moves)
+PACKED_KERNEL(ctransposition_neighbors, perm_start, perm_ctransposition_moves)
+PACKED_KERNEL(reversal_neighbors, perm_start, perm_reversal_moves)
+PACKED_KERNEL(nni_neighbors, tree_start, tree_nni_moves)
+
+/* general graph in CSR format, no hashing */
+static int csr_neighbors(landscape *L, char *conf, char *pform) {
+  const unsigned int *adj;
+  int i, deg, nh=0;
+  hash_entry *hp;
+
+  deg = CSR_neighbors(vertex_id(L, pform), &adj);
+  if (deg>max_hits) {
+    max_hits = deg;
+    hits = (hash_entry **) xrealloc(hits, max_hits*sizeof(hash_entry *));
+  }
+  n_looked_up = deg;
+  /* backwards, like popping LIST_move_it()'s stack */
+  for (i=deg-1; i>=0; i--)
+    if ((hp = L->vertex[adj[i]])) hits[nh++] = hp;
+  return nh;
+}
+
+/* hash entry of the readl-th structure */
+static hash_entry *new_entry(landscape *L, char *pform, const int *pov,
+			     double en) {
+  hash_entry *hp;
+  hp = L->hpool+L->readl-1;  /* (hash_entry *) space(sizeof(hash_entry)); */
+  if (L->POV_size) {
+    int i;
+    hp->POV = (int *) space(sizeof(int)*L->POV_size);
+    for(i=0;i<L->POV_size;i++) hp->POV[i]=pov[i];
+  }
+  hp->structure = pform;
+  hp->energy = en;
+  hp->n = L->readl;
+  return hp;
+}
+
+/* forget the readl-th structure, it could not be stored */
+static void drop_entry(landscape *L, hash_entry *hp) {
+  free(hp->structure);
+  free(hp->POV);
+  memset(hp, 0, sizeof(hash_entry));
+  L->readl--;
+}
+
+/* returns -1 on errors */
+static int check_neighbors(landscape *L)
+{
+  char *pform;
+  int nh;
+  hash_entry *hp;
+
+  if ((pform = L->pack_my_structure(L->form))==NULL) {
+    L->readl--;
+    return run_error(L, NULL);
+  }
+  /* find all neighbors of configuration we've seen before */
+  nh = L->find_neighbors(L, L->form, pform);
+  L->n_neighbors += n_looked_up;
+  hp = new_entry(L, pform, L->POV, L->energy);
+  flood(L, hp, hits, nh);
+  /* store configuration "Structure" in hash table */
+  if (store_structure(L, hp)) {
+    drop_entry(L, hp);
+    return run_error(L, "duplicate structure");
+  }
+  return 0;
+}
+
+/* With --threads the input is flooded in windows of win_size
+   structures. The structures of a window are entered into the hash as
+   they are read. Then the threads look up their neighbors, keeping
+   only those that come earlier in the input, i.e. exactly the ones
+   check_neighbors() would have found. Meanwhile the main thread
+   commits the previous window: flood() and merge_basins() are applied
+   in input order, so the result does not depend on the threads. */
+static int add_to_window(landscape *L, double en) {
+  win_member *m;
+  char *pform;
+  if ((pform = L->pack_my_structure(L->form))==NULL) {
+    L->readl--;
+    return run_error(L, NULL);
+  }
+  m = L->win[L->cur_win] + L->win_n[L->cur_win];
+  m->energy = en;
+  m->hp = new_entry(L, pform, L->POV, en);
+  if (store_structure(L, m->hp)) {
+    drop_entry(L, m->hp);
+    return run_error(L, "duplicate structure");
+  }
+  L->win_n[L->cur_win]++;
+  m->form = (L->packed_moves || L->csr_graph) ? NULL : strdup(L->form);
+  return 0;
+}
+
+static void window_lookup(landscape *L, win_member *m) {
+  int i, nh;
+  nh = L->find_neighbors(L, m->form, m->hp->structure);
+  if (nh>m->max_hits) {
+    m->max_hits = nh;
+    m->hits = (hash_entry **) xrealloc(m->hits, nh*sizeof(hash_entry *));
+  }
+  for (m->nh=i=0; i<nh; i++)
+    if (hits[i]->n < m->hp->n) m->hits[m->nh++] = hits[i];
+}
+
+#if HAVE_PTHREAD
+/* returns the number of neighbors looked up */
+static unsigned long window_lookups(landscape *L) {
+  int k, e;
+  unsigned long n=0;
+  for (;;) {
+    pthread_mutex_lock(&L->win_lock);
+    k = L->lookup_next; L->lookup_next += WIN_CHUNK;
+    pthread_mutex_unlock(&L->win_lock);
+    if (k>=L->lookup_n) break;
+    for (e = (k+WIN_CHUNK<L->lookup_n) ? k+WIN_CHUNK : L->lookup_n; k<e; k++) {
+      window_lookup(L, L->lookup_win+k);
+      n += n_looked_up;
+    }
+  }
+  return n;
+}
+
+static void *lookup_thread(void *arg) {
+  landscape *L = (landscape *) arg;
+  int round=0;
+  unsigned long n;
+  use_moves(L);
+  pthread_mutex_lock(&L->pool_lock);
+  for (;;) {
+    while (round==L->pool_round && !L->pool_quit)
+      pthread_cond_wait(&L->pool_start, &L->pool_lock);
+    if (L->pool_quit) break;
+    round = L->pool_round;
+    pthread_mutex_unlock(&L->pool_lock);
+    n = window_lookups(L);
+    pthread_mutex_lock(&L->pool_lock);
+    L->n_neighbors += n;
+    if (--L->pool_busy==0) pthread_cond_signal(&L->pool_done);
+  }
+  pthread_mutex_unlock(&L->pool_lock);
+  free_stapel();
+  free(hits); hits = NULL; max_hits = 0;
+  free(batch_keys); batch_keys = NULL; max_batch_keys = 0;
+  free_move_buffers();
+  RNA_free_thread();
+  return NULL;
+}
+
+static int start_threads(landscape *L, int n) {
+  int i;
+  L->n_threads = n;
+  pthread_mutex_init(&L->pool_lock, NULL);
+  pthread_mutex_init(&L->win_lock, NULL);
+  pthread_cond_init(&L->pool_start, NULL);
+  pthread_cond_init(&L->pool_done, NULL);
+  L->pool = (pthread_t *) space(n*sizeof(pthread_t));
+  for (i=1; i<n; i++)
+    if (pthread_create(L->pool+i, NULL, lookup_thread, L)) {
+      L->n_threads = i;   /* stop_threads() joins those we have */
+      return run_error(L, "can't create thread");
+    }
+  return 0;
+}
+
+static void stop_threads(landscape *L) {
+  int i;
+  if (L->pool==NULL) return;
+  pthread_mutex_lock(&L->pool_lock);
+  L->pool_quit = 1;
+  pthread_cond_broadcast(&L->pool_start);
+  pthread_mutex_unlock(&L->pool_lock);
+  for (i=1; i<L->n_threads; i++) pthread_join(L->pool[i], NULL);
+  free(L->pool);
+  L->pool = NULL;
+  pthread_mutex_destroy(&L->pool_lock);
+  pthread_mutex_destroy(&L->win_lock);
+  pthread_cond_destroy(&L->pool_start);
+  pthread_cond_destroy(&L->pool_done);
+}
+
+/* hand window w to the threads */
+static void start_lookups(landscape *L, win_member *w, int n) {
+  L->lookup_win = w; L->lookup_n = n; L->lookup_next = 0;
+  pthread_mutex_lock(&L->pool_lock);
+  L->pool_busy = L->n_threads-1;
+  L->pool_round++;
+  pthread_cond_broadcast(&L->pool_start);
+  pthread_mutex_unlock(&L->pool_lock);
+}
+
+/* help with the remaining lookups, then wait for the threads */
+static void finish_lookups(landscape *L) {
+  unsigned long n;
+  n = window_lookups(L);
+  pthread_mutex_lock(&L->pool_lock);
+  L->n_neighbors += n;
+  while (L->pool_busy) pthread_cond_wait(&L->pool_done, &L->pool_lock);
+  pthread_mutex_unlock(&L->pool_lock);
+}
+#else
+static int start_threads(landscape *L, int n) {
+  fprintf(stderr, "barriers was built without thread support,"
+	  " ignoring --threads\n");
+  return 0;
+}
+static void stop_threads(landscape *L) {}
+static void start_lookups(landscape *L, win_member *w, int n) {
+  L->lookup_win = w; L->lookup_n = n;
+}
+static void finish_lookups(landscape *L) {
+  int k;
+  for (k=0; k<L->lookup_n; k++) {
+    window_lookup(L, L->lookup_win+k);
+    L->n_neighbors += n_looked_up;
+  }
+}
+#endif
+
+/* flood the structures of window w in input order, returns 1 if
+   max_print saddles were found after the first *nc of them, -1 if
+   there was an error */
+static int commit_window(landscape *L, win_member *w, int n, int *nc) {
+  int k;
+  for (k=0; k<n; k++) {
+    if (w[k].energy>L->energy) {
+      /* new energy band started */
+      merge_basins(L);
+      L->n_comp=0;
+      if (L->snap_every && w[k].hp->n-1>=L->next_snap)
+	write_snapshot(L, w[k].hp->n-1);
+      if (L->n_targets && targets_merged(L, w[k].hp->n-1)) {
+	L->readl = w[k].hp->n-1;
+	*nc = k;
+	return 1;
+      }
+    }
+    L->energy = w[k].energy;
+    flood(L, w[k].hp, w[k].hits, w[k].nh);
+    if (L->failed || (L->n_saddle+1 == L->max_print && !L->flood_all)) {
+      L->readl = w[k].hp->n;
+      *nc = k+1;
+      return (L->failed) ? -1 : 1;
+    }
+  }
+  *nc = n;
+  return 0;
+}
+
+/* forget structures stored speculatively beyond the end of flooding */
+static void drop_window(landscape *L, win_member *w, int k, int n) {
+  for (; k<n; k++) {
+    if (L->csr_graph) L->vertex[vertex_id(L, w[k].hp->structure)] = NULL;
+    else delete_hash(L->hash, w[k].hp);
+    free(w[k].hp->structure);
+    free(w[k].hp->POV);
+  }
+}
+
+/* look up the window just read while committing the previous one,
+   returns 1 once max_print saddles have been found, -1 on errors */
+static int flood_window(landscape *L) {
+  win_member *w = L->win[L->cur_win], *prev = L->win[1-L->cur_win];
+  int k, n = L->win_n[L->cur_win], nprev = L->win_n[1-L->cur_win], nc, done;
+  start_lookups(L, w, n);
+  done = commit_window(L, prev, nprev, &nc);
+  finish_lookups(L);
+  if (done) {
+    drop_window(L, prev, nc, nprev);
+    drop_window(L, w, 0, n);
+  }
+  for (k=0; k<nprev; k++) free(prev[k].form);
+  L->win_n[1-L->cur_win] = 0;
+  if (done) {
+    for (k=0; k<n; k++) free(w[k].form);
+    L->win_n[L->cur_win] = 0;
+  }
+  L->cur_win = 1-L->cur_win;  /* w is committed next time */
+  return done;
+}
+
+/* assign structure me to basin, gradient basin and connected component
+   given the nh neighbors in hits that come before it in the input */
+static void flood(landscape *L, hash_entry *me, hash_entry **hits, int nh)
 {
-  char *p, *pp, *pform;
-  int basin, obasin=-1;
-  hash_entry *hp, h, *down=NULL;
-  Set *basins; basinT b;
+  char *pform = me->structure;
+  int i, basin, obasin=-1;
+  hash_entry *hp, *down=NULL;
+  Set bset, *basins=&bset; basinT b;
 
   double minenergia =  100000000.0;  /* energy of lowest neighbor */
   double Zi;
@@ -468,31 +1547,32 @@ void check_neighbors(void)
   int   gradmin=0;          /* for Gradient Basins */
   int is_min=1;
   int ccomp=0;              /* which connected component */
-  basins = new_set(10);
-
-  Zi = exp((mfe-energy)/kT);
-
-  /* foreach neighbor structure of configuration "Structure" */
-  while ((p = pop())) {
-    pp = pack_my_structure(p);
-    h.structure = pp;
 
+  if (L->cache_edges) store_edges(L, me, hits, nh);
+  if (L->minima_only) {
+    descend(L, me, hits, nh);
+    return;
+  }
+  set_init(basins);
 
-    hp = lookup_hash(&h);
+  Zi = exp((L->mfe-L->energy)/L->kT);
 
-    if (hp && POV_size) { /* need to check if h is dominated by hp */
-      int i;
-      for(i=0;i<POV_size;i++) {
-	/* printf(" %d",hp->POV[i]); */
-	if (POV[i] < hp->POV[i]) { hp=NULL; break; }
+  /* foreach neighbor structure of configuration "Structure" */
+  for (i=0; i<nh; i++) {
+    hp = hits[i];
+
+    if (L->POV_size) { /* need to check if h is dominated by hp */
+      int j;
+      for(j=0;j<L->POV_size;j++) {
+	/* printf(" %d",hp->POV[j]); */
+	if (me->POV[j] < hp->POV[j]) { hp=NULL; break; }
       }
     }
-    /* check whether we've seen the structure before */
     if (hp) {
       /* because we've seen this structure before, it already */
       /* belongs to the basin of attraction of a local minimum */
       basin = hp->basin;
-      if ( hp->energy < energy) is_min=0;  /* should we use hp->n here? */
+      if ( hp->energy < L->energy) is_min=0;  /* should we use hp->n here? */
       if ( hp->n < min_n ) {         /* find lowest energy neighbor */
 	minenergia = hp->energy;
 	min_n = hp->n;
@@ -502,22 +1582,20 @@ void check_neighbors(void)
 
       /* careful: if input has higher precision than FLT_EPSILON
 	 bad things will happen */
-      if ( fabs(hp->energy - energy)<=FLT_EPSILON*fabs(energy)) {
-	int tc; tc = hp->ccomp;
-	while (tc != truecomp[tc]) tc = truecomp[tc];
+      if ( fabs(hp->energy - L->energy)<=FLT_EPSILON*fabs(L->energy)) {
+	int tc; tc = find_comp(L, hp->ccomp);
 	if (ccomp==0)
 	  ccomp = tc;
 	else {
-	  while (ccomp != truecomp[ccomp]) ccomp = truecomp[ccomp];
-	  if (ccomp != tc) merge_components(tc, ccomp);
-	  ccomp = truecomp[ccomp];
+	  ccomp = find_comp(L, ccomp);
+	  if (ccomp != tc) ccomp = merge_components(L, tc, ccomp);
 	}
       }
       /* the basin of attraction of this local minimum may have been */
       /* merged with the basin of attraction of an energetically */
       /* "deeper" local minimum in a previous step */
       /* go and find this "deeper" local minimum! */
-      while (lmin[basin].father) basin=lmin[basin].father;
+      basin = find_basin(L, basin);
 
       /* put the "deepest" local minimum into the basins-list */
       if (basin != obasin) {
@@ -526,163 +1604,667 @@ void check_neighbors(void)
       }
       obasin = basin;
     }
-    free(pp);
   }
 
-  pform = pack_my_structure(form);
-
   if (ccomp==0) {
     /* new compnent */
     Set *set;
-    set = new_set(10);
-    if (++n_comp>max_comp) {
-      max_comp *= 2;
-      comp = (struct comp*) xrealloc(comp, (max_comp+1)*sizeof(struct comp));
-      truecomp = (int*) xrealloc(truecomp, (max_comp+1)*sizeof(int));
+    set = new_set_arena(L->band);
+    if (++L->n_comp>L->max_comp) {
+      L->max_comp *= 2;
+      L->comp = (struct comp*) xrealloc(L->comp, (L->max_comp+1)*sizeof(struct comp));
+      L->truecomp = (int*) xrealloc(L->truecomp, (L->max_comp+1)*sizeof(int));
     }
-    comp[n_comp].basins = set;
-    comp[n_comp].saddle = pform;
-    comp[n_comp].size = 0;
-    truecomp[n_comp] = ccomp = n_comp;
+    L->comp[L->n_comp].basins = set;
+    L->comp[L->n_comp].saddle = pform;
+    L->comp[L->n_comp].size = 0;
+    L->comp[L->n_comp].rank = 0;
+    L->comp[L->n_comp].next = L->comp[L->n_comp].first = L->n_comp;
+    L->truecomp[L->n_comp] = ccomp = L->n_comp;
   }
 
   if (is_min) {
     basinT b;
     /* Structure is a "new" local minimum */
-    gradmin = ++n_lmin;        /* for Gradient Basins */
+    gradmin = new_lmin(L, me, Zi);   /* for Gradient Basins */
     down = NULL;
-    /* need to allocate more space for the lmin-list */
-    if (n_lmin > max_lmin) {
-      fprintf(stderr, "increasing lmin array to %d\n",max_lmin*2);
-      lmin = (loc_min *) xrealloc(lmin, (max_lmin*2+1)*sizeof(loc_min));
-      memset(lmin + max_lmin +1, 0, max_lmin);
-      max_lmin *= 2;
-    }
-
-    /* store configuration "Structure" in lmin-list */
-    lmin[n_lmin].father = 0;
-    lmin[n_lmin].structure = pform;
-    lmin[n_lmin].energy = energy;
-    lmin[n_lmin].my_GradPool = 0;
-    lmin[n_lmin].my_pool = 1;
-    lmin[n_lmin].Z = Zi;
-    lmin[n_lmin].Zg = 0;
-    b.basin = n_lmin; b.hp=NULL;
+    b.basin = L->n_lmin; b.hp=NULL;
     set_add(basins, &b);
   }
-  else comp[ccomp].size++;
-  set_merge(comp[ccomp].basins, basins);
+  else L->comp[ccomp].size++;
+  set_append(L->comp[ccomp].basins, basins->data, basins->num_elem);
 
   {
     int i_lmin;
-    i_lmin = (is_min) ? n_lmin : basins->data[0].basin;
-    set_kill(basins);
-    /* store configuration "Structure" in hash table */
-    hp = hpool+readl-1;  /* (hash_entry *) space(sizeof(hash_entry)); */
-    if (POV_size) {
-      int i;
-      hp->POV = (int *) space(sizeof(int)*POV_size);
-      for(i=0;i<POV_size;i++) hp->POV[i]=POV[i];
+    i_lmin = (is_min) ? L->n_lmin : basins->data[0].basin;
+    set_clear(basins);
+    me->basin = i_lmin;
+    me->GradientBasin = gradmin;    /* for Gradient Basins */
+    me->down = down;
+    me->ccomp = ccomp;
+    L->lmin[gradmin].my_GradPool++;
+    L->lmin[gradmin].Zg += Zi;
+  }
+}
+
+/* enter structure me of Boltzmann weight Zi as a new local minimum,
+   returns its index in lmin */
+static int new_lmin(landscape *L, hash_entry *me, double Zi) {
+  loc_min *m;
+  /* need to allocate more space for the lmin-list */
+  if (++L->n_lmin > L->max_lmin) {
+    fprintf(stderr, "increasing lmin array to %d\n",L->max_lmin*2);
+    grow_lmin(L);
+  }
+  if (L->lmin_id) L->lmin_id[L->n_lmin] = ++L->n_id;
+
+  /* store configuration "Structure" in lmin-list */
+  m = L->lmin + L->n_lmin;
+  m->father = 0;
+  L->uf[L->n_lmin] = L->n_lmin;
+  m->structure = me->structure;
+  m->energy = L->energy;
+  m->my_GradPool = 0;
+  m->my_pool = 1;
+  m->Z = Zi;
+  m->Zg = 0;
+  if (L->POV_size) m->POV = me->POV;
+  return L->n_lmin;
+}
+
+/* --minima: like flood(), but only follow me to the gradient basin of
+   its lowest neighbor, no components or basin sets are kept. As in
+   flood(), a structure without lower neighbors is a new local minimum,
+   so the gradient basins are the same. Minima on a plateau of equal
+   energy are joined in uf, the first one being the root, and a plateau
+   that reaches a lower structure is joined to the basin below it. The
+   roots of uf are then the minima flood() finds with a nonzero barrier,
+   see make_truemin(). */
+static void descend(landscape *L, hash_entry *me, hash_entry **hits, int nh)
+{
+  int i, j, r, lower=0, below=0, plateau=0;
+  int gradmin=0, min_n=1000000000;
+  hash_entry *hp, *down=NULL;
+  double Zi, eps = FLT_EPSILON*fabs(L->energy);
+
+  Zi = exp((L->mfe-L->energy)/L->kT);
+  for (i=0; i<nh; i++) {
+    hp = hits[i];
+    if (L->POV_size) { /* is me dominated by hp? */
+      for (j=0; j<L->POV_size; j++)
+	if (me->POV[j] < hp->POV[j]) break;
+      if (j<L->POV_size) continue;
+    }
+    if (hp->n < min_n) {         /* lowest energy neighbor */
+      min_n = hp->n;
+      gradmin = hp->GradientBasin;
+      down = hp;
+    }
+    if (hp->energy < L->energy) lower=1;
+    if (fabs(hp->energy - L->energy)<=eps) {
+      r = find_basin(L, hp->GradientBasin);
+      if (fabs(L->lmin[r].energy - L->energy)>eps) {
+	/* hp's plateau reaches lower structures already */
+	if (!below) below = r;
+      }
+      else if (!plateau) plateau = r;
+      else if (r!=plateau) {
+	/* me joins two plateaus, the later root goes */
+	if (r<plateau) { L->uf[plateau] = r; plateau = r; }
+	else L->uf[r] = plateau;
+      }
     }
-    hp->structure = pform;
-    hp->energy = energy;
-    hp->basin = i_lmin;
-    hp->GradientBasin = gradmin;    /* for Gradient Basins */
-    hp->down = down;
-    hp->ccomp = ccomp;
-    hp->n = readl;
-    lmin[gradmin].my_GradPool++;
-    lmin[gradmin].Zg += Zi;
-    if (write_hash(hp))
-      nrerror("duplicate structure");
   }
 
-  if((is_min)&&(POV_size)) lmin[n_lmin].POV = hp->POV;
+  if (!lower) {
+    gradmin = new_lmin(L, me, Zi);
+    down = NULL;
+    if (plateau) L->uf[gradmin] = plateau;
+    else plateau = gradmin;
+  }
+  else if (!below) below = find_basin(L, gradmin);
+  if (plateau && below) L->uf[plateau] = below;
+  me->basin = me->GradientBasin = gradmin;
+  me->down = down;
+  me->ccomp = 0;
+  L->lmin[gradmin].my_GradPool++;
+  L->lmin[gradmin].Zg += Zi;
+}
+
+/* --cache-edges: keep the nh neighbors of me that come before it in
+   the input, for compute_rates() */
+static void store_edges(landscape *L, hash_entry *me, hash_entry **hits,
+			int nh) {
+  int i, k = me->n-1-L->edge_base;
+  if (k>=L->max_edge_n) {
+    L->max_edge_n = 2*L->max_edge_n+1024;
+    L->edge_n = (int *) xrealloc(L->edge_n, L->max_edge_n*sizeof(int));
+  }
+  L->edge_n[k] = nh;
+  if (L->edge_fp) {
+    unsigned int buf[256];
+    int j;
+    for (i=0; i<nh; i+=j) {
+      for (j=0; j<256 && i+j<nh; j++) buf[j] = hits[i+j]->n-1;
+      if (fwrite(buf, sizeof(unsigned int), j, L->edge_fp)!=(size_t) j &&
+	  !L->failed) run_error(L, "can't write edge file");
+    }
+    L->n_edges += nh;
+    return;
+  }
+  if (L->n_edges+nh>L->max_edges) {
+    L->max_edges = 2*L->max_edges+nh+4096;
+    L->edge_adj = (unsigned int *)
+      xrealloc(L->edge_adj, L->max_edges*sizeof(unsigned int));
+  }
+  for (i=0; i<nh; i++) L->edge_adj[L->n_edges++] = hits[i]->n-1;
 }
 
-static void merge_basins() {
+/* put the neighbors stored for structure r into hits; ec must be at
+   the first edge of r, it is moved on to the next structure. If the
+   edge file can't be read, ec->failed is set. */
+static int cached_neighbors(landscape *L, int r, edge_cursor *ec) {
+  int i, nh = L->edge_n[r-L->edge_base];
+  unsigned int *adj;
+  if (nh>max_hits) {
+    max_hits = nh;
+    hits = (hash_entry **) xrealloc(hits, max_hits*sizeof(hash_entry *));
+  }
+  if (ec->fp) {
+    if (nh>ec->max_buf) {
+      ec->max_buf = nh;
+      ec->buf = (unsigned int *) xrealloc(ec->buf, nh*sizeof(unsigned int));
+    }
+    adj = ec->buf;
+    if (fread(adj, sizeof(unsigned int), nh, ec->fp)!=(size_t) nh) {
+      ec->failed = 1;
+      return 0;
+    }
+  }
+  else adj = L->edge_adj + ec->next;
+  ec->next += nh;
+  for (i=0; i<nh; i++) hits[i] = L->hpool + adj[i];
+  return nh;
+}
+
+/* move ec to edge e */
+static void seek_edges(edge_cursor *ec, unsigned long e) {
+  if (ec->fp && ec->next!=e &&
+      fseek(ec->fp, (long) (e*sizeof(unsigned int)), SEEK_SET))
+    ec->failed = 1;
+  ec->next = e;
+}
+
+static void merge_basins(landscape *L) {
   int c, i, t;
-  for (i=t=1; i<=n_comp; i++) {
-    if (truecomp[i]==i)
-      comp[t++]=comp[i];
-    else set_kill(comp[i].basins);
-  }
-  n_comp = t-1;
-  qsort(comp+1, n_comp, sizeof(struct comp), comp_comps);
-  for (c=1; c<=n_comp; c++) { /* foreach connected component */
+  /* collect the basins of each component at its root */
+  for (i=1; i<=L->n_comp; i++) {
+    if (L->truecomp[i]!=i) continue;
+    for (c=L->comp[i].next; c!=i; c=L->comp[c].next)
+      set_append(L->comp[i].basins, L->comp[c].basins->data,
+		 L->comp[c].basins->num_elem);
+    set_sort(L->comp[i].basins);
+  }
+  for (i=t=1; i<=L->n_comp; i++) {
+    if (L->truecomp[i]==i)
+      L->comp[t++]=L->comp[i];
+  }
+  L->n_comp = t-1;
+  qsort(L->comp+1, L->n_comp, sizeof(struct comp), comp_comps);
+  for (c=1; c<=L->n_comp; c++) { /* foreach connected component */
     /* merge all lmins connected by this component */
-    static int false_lmin=0;
-    int i, father, pool=0;
+    int i, father, size=0;
     double Z=0;
     basinT *basins;
 
-    if (mergefile && (comp[c].basins->num_elem>1)) {
+    if (L->mergefile && (L->comp[c].basins->num_elem>1)) {
       const char format[2][16] = {"%13.5f %4d %s", "%6.2f %4d %s"};
       char *saddle;
-      saddle = unpack_my_structure(comp[c].saddle);
-      fprintf(mergefile, format[IS_RNA], energy, comp[c].size, saddle);
+      saddle = L->unpack_my_structure(L->comp[c].saddle);
+      fprintf(L->mergefile, format[L->IS_RNA], L->energy, L->comp[c].size, saddle);
       free(saddle);
-      for (i=0; i < comp[c].basins->num_elem; i++)
-	fprintf(mergefile, " %2d", comp[c].basins->data[i].basin);
-      fprintf(mergefile, "\n");
+      for (i=0; i < L->comp[c].basins->num_elem; i++)
+	fprintf(L->mergefile, " %2d", min_id(L->comp[c].basins->data[i].basin));
+      fprintf(L->mergefile, "\n");
     }
 
-    basins = comp[c].basins->data;
-    father = basins[0].basin;
-    while (lmin[father].father) father=lmin[father].father;
+    basins = L->comp[c].basins->data;
+    father = find_basin(L, basins[0].basin);
 
-    for (i = 1; i < comp[c].basins->num_elem; i++) {
+    for (i = 1; i < L->comp[c].basins->num_elem; i++) {
       int ii, l, r;
-      ii = basins[i].basin;
-      while (lmin[ii].father) ii=lmin[ii].father;
+      ii = find_basin(L, basins[i].basin);
       if (ii!=father) {
 	if (ii<father) {int tmp; tmp=ii; ii=father; father=tmp; l=0; r=i;}
 	else {l=i; r=0;}
 	/* going to merge ii with father  */
-	if ((!max_print) || (ii<=max_print+false_lmin)) {
+	if ((!L->max_print) || (min_id(ii)<=L->max_print+L->false_lmin)) {
 	  /* found the saddle for a basin we're gonna print */
-	  if (energy-lmin[ii].energy>=minh) n_saddle++;
-	  else false_lmin++;
+	  if (L->energy-L->lmin[ii].energy>=L->minh) L->n_saddle++;
+	  else L->false_lmin++;
 	}
 
-	lmin[ii].father = father;
-	lmin[ii].saddle = comp[c].saddle;
-	lmin[ii].E_saddle = energy;
-	lmin[ii].left =  basins[l].hp;
-	lmin[ii].right = basins[r].hp;
-	if (bsize) {
-	  lmin[ii].fathers_pool = lmin[father].my_pool;
-	  pool += lmin[ii].my_pool;
-	  Z += lmin[ii].Z;
+	L->lmin[ii].father = father;
+	L->uf[ii] = father;
+	L->lmin[ii].saddle = L->comp[c].saddle;
+	L->lmin[ii].E_saddle = L->energy;
+	L->lmin[ii].left =  basins[l].hp;
+	L->lmin[ii].right = basins[r].hp;
+	if (L->stream) stream_min(L, ii, L->energy);
+	/* as make_truemin() will decide */
+	if (L->prune && L->lmin[ii].E_saddle-L->lmin[ii].energy < L->minh)
+	  L->n_pruned++;
+	if (L->bsize) {
+	  L->lmin[ii].fathers_pool = L->lmin[father].my_pool;
+	  size += L->lmin[ii].my_pool;
+	  Z += L->lmin[ii].Z;
 	}
       }
     }
-    if (bsize) {
-      lmin[father].my_pool += pool + comp[c].size;
-      lmin[father].Z += Z + comp[c].size * exp((mfe-energy)/kT);
+    if (L->bsize) {
+      L->lmin[father].my_pool += size + L->comp[c].size;
+      L->lmin[father].Z += Z + L->comp[c].size * exp((L->mfe-L->energy)/L->kT);
+    }
+  }
+  /* saddles and structures are owned by the hash, nothing to copy */
+  arena_reset(L->band);
+  /* rewriting the basins of all structures is worth it once the
+     dropped minima are a good part of lmin and of the structures */
+  if (L->n_pruned>=PRUNE_MIN && 2*L->n_pruned>=L->n_lmin &&
+      32*(unsigned long) L->n_pruned>=(unsigned long) L->readl)
+    compact_lmin(L);
+}
+
+/* double the size of the lmin array */
+static void grow_lmin(landscape *L) {
+  L->lmin = (loc_min *) xrealloc(L->lmin, (L->max_lmin*2+1)*sizeof(loc_min));
+  memset(L->lmin + L->max_lmin +1, 0, L->max_lmin*sizeof(loc_min));
+  L->uf = (int *) xrealloc(L->uf, (L->max_lmin*2+1)*sizeof(int));
+  if (L->lmin_id)
+    L->lmin_id = (int *) xrealloc(L->lmin_id, (L->max_lmin*2+1)*sizeof(int));
+  L->max_lmin *= 2;
+}
+
+/* --prune: remove the merged minima with barriers below minh from lmin,
+   make_truemin() would skip them anyway. The remaining ones keep their
+   order, structures in a removed basin go to its first remaining
+   ancestor, which is the macro state compute_rates() would use. */
+static void compact_lmin(landscape *L) {
+  int i, n, *map, old=L->n_lmin;
+  unsigned long r;
+
+  map = (int *) space((L->n_lmin+1)*sizeof(int));
+  /* point uf directly to the roots, which are never removed */
+  for (i=1; i<=L->n_lmin; i++) find_basin(L, i);
+  for (i=n=1; i<=L->n_lmin; i++) {
+    loc_min *m = L->lmin+i;
+    if (m->father && m->E_saddle - m->energy < L->minh)
+      map[i] = map[m->father];   /* fathers come first */
+    else {
+      map[i] = n;
+      L->uf[n] = map[L->uf[i]];
+      L->lmin_id[n] = L->lmin_id[i];
+      L->lmin[n] = *m;
+      L->lmin[n].father = map[m->father];
+      n++;
+    }
+  }
+  for (r=0; r<(unsigned long) L->readl; r++) {
+    L->hpool[r].basin = map[L->hpool[r].basin];
+    L->hpool[r].GradientBasin = map[L->hpool[r].GradientBasin];
+  }
+  free(map);
+  L->n_lmin = n-1;
+  L->n_pruned = 0;
+  memset(L->lmin+n, 0, (old-n+1)*sizeof(loc_min));
+  while (L->max_lmin>16383 && (unsigned int) L->n_lmin<L->max_lmin/4) {
+    L->max_lmin /= 2;
+    L->lmin = (loc_min *) xrealloc(L->lmin, (L->max_lmin+1)*sizeof(loc_min));
+    L->uf = (int *) xrealloc(L->uf, (L->max_lmin+1)*sizeof(int));
+    L->lmin_id = (int *) xrealloc(L->lmin_id, (L->max_lmin+1)*sizeof(int));
+  }
+  if (L->verbose)
+    fprintf(stderr, "dropped %d shallow minima, %d left\n", old-L->n_lmin,
+	    L->n_lmin);
+}
+
+/* --stream: write minimum i as soon as its saddle is known, in the
+   format of print_results(). Minima are numbered in the order they
+   were found, as are the fathers. */
+static void stream_min(landscape *L, int i, double E_saddle) {
+  loc_min *m = L->lmin+i;
+  char *struc;
+
+  if (E_saddle - m->energy < L->minh) return;
+  struc = L->unpack_my_structure(m->structure);
+  if (L->IS_RNA)
+    fprintf(L->stream, "%4d %s %6.2f %4d %6.2f", min_id(i), struc,
+	    m->energy, min_id(m->father), E_saddle - m->energy);
+  else
+    fprintf(L->stream, "%4d %s %13.5f %4d %13.5f", min_id(i), struc,
+	    m->energy, min_id(m->father), E_saddle - m->energy);
+  if (L->print_saddles) {
+    if (m->saddle) {
+      free(struc);
+      struc = L->unpack_my_structure(m->saddle);
+    }
+    else memset(struc, '~', strlen(struc));
+    fprintf(L->stream, " %s", struc);
+  }
+  free(struc);
+  fprintf(L->stream, "\n");
+  fflush(L->stream);
+}
+
+/* --stream: progress record, marked by a leading # */
+static void stream_progress(landscape *L) {
+  unsigned long size;
+  size = (L->csr_graph) ? L->n_vertex : HASHSIZE+1;
+  fprintf(L->stream, "# read %d energy %.5f minima %d saddles %d load %.4f\n",
+	  L->readl, L->last_en, (L->lmin_id) ? L->n_id : L->n_lmin, L->n_saddle,
+	  (double) L->readl/size);
+  fflush(L->stream);
+}
+
+/* graph, move set and sequence of the run, \0 separated and padded
+   to a multiple of 8 bytes; returns the length */
+static int snap_meta(landscape *L, char **meta) {
+  int l1, l2, l3, len;
+  l1 = strlen(L->opt.GRAPH)+1;
+  l2 = strlen(L->opt.MOVESET)+1;
+  l3 = strlen(L->opt.seq)+1;
+  len = (l1+l2+l3+7) & ~7;
+  *meta = (char *) space(len);
+  memcpy(*meta, L->opt.GRAPH, l1);
+  memcpy(*meta+l1, L->opt.MOVESET, l2);
+  memcpy(*meta+l1+l2, L->opt.seq, l3);
+  return len;
+}
+
+/* index of hp in hpool, -1 for NULL */
+static int snap_index(landscape *L, hash_entry *hp) {
+  return (hp) ? (int) (hp-L->hpool) : -1;
+}
+
+/* index of the entry owning key */
+static int snap_key_index(landscape *L, char *key) {
+  return (key) ? snap_index(L, lookup_structure(L, key)) : -1;
+}
+
+/* write the first n structures and the minima found by them to
+   snap_name; the file is replaced only once it is complete */
+static void write_snapshot(landscape *L, int n) {
+  snap_header h;
+  char *meta, *tmp;
+  FILE *fp;
+  int i, bad;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SNAP_MAGIC, 8);
+  h.readl = n;
+  h.n_lmin = L->n_lmin;
+  h.n_id = (L->lmin_id) ? L->n_id : L->n_lmin;
+  h.minima_only = L->minima_only;
+  h.n_saddle = L->n_saddle;
+  h.false_lmin = L->false_lmin;
+  h.POV_size = L->POV_size;
+  h.spin_len = L->mc->spin_len;
+  h.perm_n = L->mc->perm_n;
+  h.tree_n = L->mc->tree_n;
+  h.meta_len = snap_meta(L, &meta);
+  h.energy = L->energy;
+  h.mfe = L->mfe;
+  h.kT = L->kT;
+  for (i=0; i<n; i++)
+    h.keys_len += strlen(L->hpool[i].structure)+1;
+
+  tmp = (char *) space(strlen(L->snap_name)+5);
+  strcat(strcpy(tmp, L->snap_name), ".tmp");
+  fp = fopen(tmp, "wb");
+  if (fp==NULL) {
+    fprintf(stderr, "can't open snapshot file %s\n", tmp);
+    free(tmp); free(meta);
+    return;
+  }
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(meta, 1, h.meta_len, fp);
+  for (i=0; i<n; i++) {
+    hash_entry *hp = L->hpool+i;
+    snap_entry e;
+    e.energy = hp->energy;
+    e.basin = hp->basin;
+    e.GradientBasin = hp->GradientBasin;
+    e.down = snap_index(L, hp->down);
+    fwrite(&e, sizeof(e), 1, fp);
+  }
+  for (i=0; i<n && L->POV_size; i++)
+    fwrite(L->hpool[i].POV, sizeof(int), L->POV_size, fp);
+  for (i=1; i<=L->n_lmin; i++) {
+    loc_min *m = L->lmin+i;
+    snap_min sm;
+    memset(&sm, 0, sizeof(sm));   /* no stray bytes in the padding */
+    sm.id = min_id(i);
+    sm.father = m->father;
+    sm.uf = L->uf[i];
+    sm.structure = snap_key_index(L, m->structure);
+    sm.saddle = snap_key_index(L, m->saddle);
+    sm.left = snap_index(L, m->left);
+    sm.right = snap_index(L, m->right);
+    sm.E_saddle = m->E_saddle;
+    sm.energy = m->energy;
+    sm.Z = m->Z;
+    sm.Zg = m->Zg;
+    sm.my_GradPool = m->my_GradPool;
+    sm.my_pool = m->my_pool;
+    sm.fathers_pool = m->fathers_pool;
+    fwrite(&sm, sizeof(sm), 1, fp);
+  }
+  for (i=0; i<n; i++)
+    fwrite(L->hpool[i].structure, 1, strlen(L->hpool[i].structure)+1, fp);
+  /* a short write (full disk) must not replace the last snapshot */
+  bad = ferror(fp);
+  if (fclose(fp) || bad) {
+    fprintf(stderr, "can't write snapshot file %s\n", tmp);
+    unlink(tmp);
+  }
+  else if (rename(tmp, L->snap_name))
+    fprintf(stderr, "can't write snapshot file %s\n", L->snap_name);
+  else if (L->verbose)
+    fprintf(stderr, "wrote snapshot of %d structures up to energy %g\n",
+	    n, L->energy);
+  L->next_snap = n + L->snap_every;
+  free(tmp);
+  free(meta);
+}
+
+/* contents of file name, its size in *size; NULL if it can't be read */
+static char *map_snapshot(const char *name, size_t *size) {
+  char *p;
+#if HAVE_MMAP
+  int fd;
+  struct stat st;
+  fd = open(name, O_RDONLY);
+  if (fd<0 || fstat(fd, &st)) {
+    fprintf(stderr, "can't open snapshot file %s\n", name);
+    if (fd>=0) close(fd);
+    return NULL;
+  }
+  *size = st.st_size;
+  p = (*size) ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (p==MAP_FAILED || p==NULL) {
+    fprintf(stderr, "can't map snapshot file %s\n", name);
+    return NULL;
+  }
+#else
+  FILE *fp;
+  fp = fopen(name, "rb");
+  if (fp==NULL) {
+    fprintf(stderr, "can't open snapshot file %s\n", name);
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  *size = ftell(fp);
+  rewind(fp);
+  p = (char *) space(*size+1);
+  if (fread(p, 1, *size, fp)!=*size) {
+    fprintf(stderr, "can't read snapshot file %s\n", name);
+    free(p);
+    p = NULL;
+  }
+  fclose(fp);
+#endif
+  return p;
+}
+
+static void unmap_snapshot(char *p, size_t size) {
+#if HAVE_MMAP
+  munmap(p, size);
+#else
+  free(p);
+#endif
+}
+
+/* give up on the snapshot mapped at p */
+static int snap_error(landscape *L, char *p, size_t size, const char *msg) {
+  unmap_snapshot(p, size);
+  return run_error(L, "load_snapshot: %s", msg);
+}
+
+/* continue the run saved in snapshot file name: the structures and
+   minima are restored, input up to the snapshot's energy is skipped.
+   Returns -1 if the snapshot doesn't fit the run. */
+static int load_snapshot(landscape *L, const char *name) {
+  snap_header h;
+  char *base, *p, *meta, *keys, *end;
+  size_t size, need;
+  int i, r, meta_len, other;
+
+  if ((p = base = map_snapshot(name, &size))==NULL)
+    return run_error(L, NULL);
+  if (size<sizeof(h))
+    return snap_error(L, base, size, "truncated snapshot");
+  memcpy(&h, p, sizeof(h));
+  if (memcmp(h.magic, SNAP_MAGIC, 8))
+    return snap_error(L, base, size, "not a barriers snapshot");
+  need = sizeof(h) + h.meta_len + h.readl*sizeof(snap_entry) +
+    (size_t) h.readl*h.POV_size*sizeof(int) + h.n_lmin*sizeof(snap_min) +
+    h.keys_len;
+  if (h.readl<0 || h.n_lmin<0 || h.meta_len<0 || size!=need ||
+      h.spin_len<0 || h.perm_n<0 || h.tree_n<0)
+    return snap_error(L, base, size, "truncated snapshot");
+  meta_len = snap_meta(L, &meta);
+  other = (meta_len!=h.meta_len || memcmp(meta, p+sizeof(h), meta_len) ||
+	   h.POV_size!=L->POV_size || h.kT!=L->kT);
+  free(meta);
+  if (other)
+    return snap_error(L, base, size, "snapshot is of another landscape");
+  if (h.minima_only!=L->minima_only)
+    return snap_error(L, base, size,
+		      "give --minima for both runs or neither");
+  if ((unsigned long) h.readl>L->hpool_size)
+    return snap_error(L, base, size, "snapshot does not fit the hash table");
+  while (h.n_lmin>(int) L->max_lmin)
+    grow_lmin(L);
+  /* the input may add nothing above the snapshot, so nothing is packed */
+  set_key_dims(h.spin_len, h.perm_n, h.tree_n);
+
+  /* the keys are at the end, readl counts the entries stored so far
+     for end_run() */
+  keys = p + size - h.keys_len;
+  end = p + size;
+  p += sizeof(h) + h.meta_len;
+  for (r=0; r<h.readl; r++, p+=sizeof(snap_entry)) {
+    hash_entry *hp = L->hpool+r;
+    snap_entry e;
+    char *z;
+    int l;
+    if ((z = memchr(keys, 0, end-keys))==NULL)
+      return snap_error(L, base, size, "truncated snapshot");
+    memcpy(&e, p, sizeof(e));
+    if (e.down>=r || e.basin<0 || e.basin>h.n_lmin)
+      return snap_error(L, base, size, "corrupt snapshot");
+    l = z-keys;
+    hp->structure = (char *) space(l+1);
+    memcpy(hp->structure, keys, l);
+    if (L->IS_arbitrary && l>L->maxlabellength) L->maxlabellength = l;
+    keys += l+1;
+    hp->energy = e.energy;
+    hp->basin = e.basin;
+    hp->GradientBasin = e.GradientBasin;
+    hp->down = (e.down<0) ? NULL : L->hpool+e.down;
+    hp->n = r+1;
+    if (store_structure(L, hp)) {
+      free(hp->structure);
+      memset(hp, 0, sizeof(hash_entry));
+      return snap_error(L, base, size, "duplicate structure");
     }
-    set_kill(comp[c].basins);
+    L->readl = r+1;
+  }
+  for (r=0; r<h.readl && L->POV_size; r++, p+=L->POV_size*sizeof(int)) {
+    L->hpool[r].POV = (int *) space(L->POV_size*sizeof(int));
+    memcpy(L->hpool[r].POV, p, L->POV_size*sizeof(int));
   }
+  L->n_lmin = h.n_lmin;   /* end_run() clears them */
+  for (i=1; i<=h.n_lmin; i++, p+=sizeof(snap_min)) {
+    loc_min *m = L->lmin+i;
+    snap_min sm;
+    memcpy(&sm, p, sizeof(sm));
+    if (sm.structure<0 || sm.structure>=h.readl || sm.saddle>=h.readl ||
+	sm.left>=h.readl || sm.right>=h.readl || sm.father<0 || sm.father>=i ||
+	sm.uf<1 || sm.uf>i)
+      return snap_error(L, base, size, "corrupt snapshot");
+    m->father = sm.father;
+    L->uf[i] = sm.uf;
+    if (L->lmin_id) L->lmin_id[i] = sm.id;
+    m->structure = L->hpool[sm.structure].structure;
+    m->saddle = (sm.saddle<0) ? NULL : L->hpool[sm.saddle].structure;
+    m->left = (sm.left<0) ? NULL : L->hpool+sm.left;
+    m->right = (sm.right<0) ? NULL : L->hpool+sm.right;
+    m->E_saddle = sm.E_saddle;
+    m->energy = sm.energy;
+    m->Z = sm.Z;
+    m->Zg = sm.Zg;
+    m->my_GradPool = sm.my_GradPool;
+    m->my_pool = sm.my_pool;
+    m->fathers_pool = sm.fathers_pool;
+    m->POV = L->hpool[sm.structure].POV;
+    if (L->prune && m->father && m->E_saddle - m->energy < L->minh)
+      L->n_pruned++;
+  }
+  unmap_snapshot(base, size);
+
+  L->n_id = h.n_id;
+  L->n_saddle = h.n_saddle;
+  L->false_lmin = h.false_lmin;
+  L->energy = L->last_en = L->resume_en = h.energy;
+  L->mfe = h.mfe;
+  L->resumed = 1;
+  if (!L->shut_up)
+    fprintf(stderr, "resumed %d structures up to energy %g from %s\n",
+	    L->readl, L->energy, name);
+  return 0;
 }
 
-void mark_global(loc_min *Lmin)
+void mark_global(landscape *L, loc_min *Lmin)
 {
   int i,j,k;
   int n_gmin;
   loc_min *G;
 
-  G = (loc_min *) space( n_lmin*sizeof(loc_min) );
+  use_moves(L);
+  G = (loc_min *) space( L->n_lmin*sizeof(loc_min) );
 
   Lmin[1].global = (char) 1;
   G[1] = Lmin[1];
   n_gmin = 1;
 
-  for (i=1; i<=n_lmin; i++) {
+  for (i=1; i<=L->n_lmin; i++) {
     Lmin[i].global = (char) 1;
     for (j=1; j<=n_gmin; j++) {
       int dom;
       dom =1;
-      for(k=0;k<POV_size;k++)
+      for(k=0;k<L->POV_size;k++)
 	if(G[j].POV[k]>=Lmin[i].POV[k]) dom=0;
       if(dom) {
 	Lmin[i].global = (char) 0;
@@ -697,91 +2279,122 @@ void mark_global(loc_min *Lmin)
 }
 
 /*====================*/
-void print_results(loc_min *Lmin, int *truemin, char *farbe)
+void print_results(landscape *L, FILE *out, loc_min *Lmin, int *truemin,
+		   char *farbe)
 {
   int i,ii,j, n;
   char *struc;
   char *format;
 
-  if (POV_size) fprintf(stderr," POV_size = %d\n",POV_size);
-  if (IS_arbitrary) {
+  use_moves(L);
+  if (L->POV_size) fprintf(stderr," POV_size = %d\n",L->POV_size);
+  if (L->IS_arbitrary) {
     char tfor[100];
-    sprintf(tfor,"%%4d %%-%ds %%6.2f %%4d %%6.2f",maxlabellength);
+    sprintf(tfor,"%%4d %%-%ds %%6.2f %%4d %%6.2f",L->maxlabellength);
     format = tfor;
   }
-  else if (IS_RNA)
+  else if (L->IS_RNA)
     format = "%4d %s %6.2f %4d %6.2f";
   else
     format = "%4d %s %13.5f %4d %13.5f";
-  if(verbose) printf("Using output format string '%s'\n",format);
+  if(L->verbose) fprintf(out, "Using output format string '%s'\n",format);
 
 
-  n_lmin = Lmin[0].fathers_pool;
+  L->n_lmin = Lmin[0].fathers_pool;
 
-  printf("     %s\n", farbe);
-  for (i = 1; i <= n_lmin; i++) {
+  fprintf(out, "     %s\n", farbe);
+  for (i = 1; i <= L->n_lmin; i++) {
     int f;
     if ((ii = truemin[i])==0) continue;
 
-    struc = unpack_my_structure(Lmin[i].structure);
+    struc = L->unpack_my_structure(Lmin[i].structure);
     n = strlen(struc);
     f = Lmin[i].father; if (f>0) f = truemin[f];
-    if(POV_size) {
+    if(L->POV_size) {
       int jj;
-      printf("%4d %s ", ii, struc);
-      if(IS_RNA) printf("%6.2f ", Lmin[i].energy);
-      else printf("%13.5f ", Lmin[i].energy);
-      for(jj=0;jj<POV_size;jj++) printf("%6d ",Lmin[i].POV[jj]);
-      if(IS_RNA) printf("%4d %6.2f",f,
+      fprintf(out, "%4d %s ", ii, struc);
+      if(L->IS_RNA) fprintf(out, "%6.2f ", Lmin[i].energy);
+      else fprintf(out, "%13.5f ", Lmin[i].energy);
+      for(jj=0;jj<L->POV_size;jj++) fprintf(out, "%6d ",Lmin[i].POV[jj]);
+      if(L->IS_RNA) fprintf(out, "%4d %6.2f",f,
 			Lmin[i].E_saddle - Lmin[i].energy);
-      else printf("%4d %13.5f",f,
+      else fprintf(out, "%4d %13.5f",f,
 		  Lmin[i].E_saddle - Lmin[i].energy);
 
-      if(Lmin[i].global) printf(" *");
-      else printf(" .");
+      if(Lmin[i].global) fprintf(out, " *");
+      else fprintf(out, " .");
     }
     else {
-      printf(format, ii, struc, Lmin[i].energy, f,
+      fprintf(out, format, ii, struc, Lmin[i].energy, f,
 	     Lmin[i].E_saddle - Lmin[i].energy);
     }
     free(struc);
 
-    if (print_saddles) {
+    if (L->print_saddles) {
       if (Lmin[i].saddle)  {
-	struc = unpack_my_structure(Lmin[i].saddle);
-	printf(" %s", struc);
+	struc = L->unpack_my_structure(Lmin[i].saddle);
+	fprintf(out, " %s", struc);
 	free(struc);
       }
       else {
-	printf(" ");
-	for (j=0;j<n;j++) { printf("~"); }
+	fprintf(out, " ");
+	for (j=0;j<n;j++) { fprintf(out, "~"); }
       }
 
     }
-    if (bsize)
-      printf (" %12ld %8ld %10.6f %8ld %10.6f",
-	      Lmin[i].my_pool, Lmin[i].fathers_pool, mfe -kT*log(lmin[i].Z),
-	      Lmin[i].my_GradPool, mfe -kT*log(lmin[i].Zg));
-    printf("\n");
+    if (L->bsize)
+      fprintf(out, " %12ld %8ld %10.6f %8ld %10.6f",
+	      Lmin[i].my_pool, Lmin[i].fathers_pool, L->mfe -L->kT*log(L->lmin[i].Z),
+	      Lmin[i].my_GradPool, L->mfe -L->kT*log(L->lmin[i].Zg));
+    fprintf(out, "\n");
+  }
+}
+
+/* --minima: list the local minima with the sizes and free energies of
+   their gradient basins */
+void print_minima(landscape *L, FILE *out, loc_min *Lmin, int *truemin,
+		  char *farbe)
+{
+  int i, j;
+  char *struc;
+
+  use_moves(L);
+  fprintf(out, "     %s\n", farbe);
+  for (i = 1; i <= Lmin[0].fathers_pool; i++) {
+    if (truemin[i]==0) continue;
+    struc = L->unpack_my_structure(Lmin[i].structure);
+    if (L->IS_arbitrary)
+      fprintf(out, "%4d %-*s %6.2f", truemin[i], L->maxlabellength, struc,
+	      Lmin[i].energy);
+    else if (L->IS_RNA)
+      fprintf(out, "%4d %s %6.2f", truemin[i], struc, Lmin[i].energy);
+    else
+      fprintf(out, "%4d %s %13.5f", truemin[i], struc, Lmin[i].energy);
+    free(struc);
+    for (j=0; j<L->POV_size; j++) fprintf(out, " %6d", Lmin[i].POV[j]);
+    fprintf(out, " %12ld %10.6f\n", Lmin[i].my_GradPool,
+	    L->mfe - L->kT*log(Lmin[i].Zg));
   }
 }
 
-void ps_tree(loc_min *Lmin, int *truemin, int rates)
+void ps_tree(landscape *L, loc_min *Lmin, int *truemin, int rates)
 {
   nodeT *nodes;
   int i,ii;
   int nlmin;
+  char *name;
 
+  use_moves(L);
   nlmin = Lmin[0].fathers_pool;
 
-  if (max_print>truemin[0]) max_print=truemin[0];
+  if (L->max_print>truemin[0]) L->max_print=truemin[0];
 
-  nodes = (nodeT *) space(sizeof(nodeT)*(max_print+1));
-  for (i=0,ii=1; i<max_print && ii<=nlmin; ii++){
+  nodes = (nodeT *) space(sizeof(nodeT)*(L->max_print+1));
+  for (i=0,ii=1; i<L->max_print && ii<=nlmin; ii++){
     register int s1, f;
     double E_saddle;
     if ((s1=truemin[ii])==0) continue;
-    if (s1>max_print)
+    if (s1>L->max_print)
       nrerror("inconsistency in ps_tree, aborting");
     E_saddle = Lmin[ii].E_saddle;
     f = Lmin[ii].father;
@@ -791,39 +2404,39 @@ void ps_tree(loc_min *Lmin, int *truemin, int rates)
     /* was truemin[f]-1; */
     if (rates) {
       double F,Ft;
-      F = mfe - kT*log(Lmin[ii].Zg);
-      Ft = (f>0) ? F -kT*log(rate[truemin[ii]][truemin[f]])  : E_saddle;
+      F = L->mfe - L->kT*log(Lmin[ii].Zg);
+      Ft = (f>0) ? F -L->kT*log(get_rate(L->rate, truemin[ii], truemin[f]))
+	: E_saddle;
       nodes[s1-1].height = F;
       nodes[s1-1].saddle_height = Ft;
     }else {
       nodes[s1-1].height = Lmin[ii].energy;
       nodes[s1-1].saddle_height = E_saddle;
     }
-    if (print_labels) {
-      char *L;
+    if (L->print_labels) {
+      char *lab;
       char *s;
-      s = unpack_my_structure(Lmin[ii].structure);
-      if ((POV_size)&&(Lmin[ii].global)) {
-	L = (char *) space(sizeof(char)*(3+strlen(s)));
-	strcat(L,s); strcat(L," *");
-	nodes[s1-1].label = L;
+      s = L->unpack_my_structure(Lmin[ii].structure);
+      if ((L->POV_size)&&(Lmin[ii].global)) {
+	lab = (char *) space(sizeof(char)*(3+strlen(s)));
+	strcat(lab,s); strcat(lab," *");
+	nodes[s1-1].label = lab;
       }
       else
 	nodes[s1-1].label = strdup(s);
       free(s);
     }
-    else if((POV_size)&&(Lmin[ii].global)) {
-      char *L;
-      L = (char *) space(sizeof(char)*10);
-      (void) sprintf(L,"%d *",s1);
-      nodes[s1-1].label = L;
+    else if((L->POV_size)&&(Lmin[ii].global)) {
+      char *lab;
+      lab = (char *) space(sizeof(char)*10);
+      (void) sprintf(lab,"%d *",s1);
+      nodes[s1-1].label = lab;
     }
     i++;
   }
-  if (rates)
-    PS_tree_plot(nodes, max_print, "treeR.ps");
-  else
-    PS_tree_plot(nodes, max_print, "tree.ps");
+  name = out_name(L, (rates) ? "treeR.ps" : "tree.ps");
+  PS_tree_plot(nodes, L->max_print, name);
+  free(name);
   free(nodes);
 }
 
@@ -840,40 +2453,6 @@ char * get_taxon_label(int i)
   return (label);
 }
 
-/*=========================================*/
-static int indx_comp(const void *i1, const void *i2)
-{
-  int i,j;
-
-  i = *((int *)i1);
-  j = *((int *)i2);
-  if (lmin[i].E_saddle == lmin[j].E_saddle)
-    return (i-j);
-  return (lmin[i].E_saddle < lmin[j].E_saddle) ? (-1) : (1);
-}
-
-/*===============================*/
-static int *make_sorted_index(int *truemin)
-{
-  int i, ii, *index;
-
-  index = (int *) space((max_print+1)*sizeof(int));
-
-  /* include only up to max_print local minima */
-  for (i = 0, ii=1; i < max_print; ii++)
-    if (truemin[ii])
-      index[i++] = ii;
-
-  /* sort local minima by saddle-point-heights */
-  /* starting with the 1st excited state */
-  qsort(index+1, max_print-1, sizeof(int), indx_comp);
-
-  return (index);
-}
-
-static path_entry *path;
-static int np, max_path;
-
 static int path_cmp(const void *a, const void *b) {
   path_entry *A, *B; int d;
   A = (path_entry *) a;
@@ -883,103 +2462,130 @@ static int path_cmp(const void *a, const void *b) {
 }
 
 /*=======*/
-path_entry *backtrack_path(int l1, int l2, loc_min *LM, int *truemin) {
-  int n_lmin, i, ll1=0, ll2=0;
+path_entry *backtrack_path(landscape *L, int l1, int l2, loc_min *LM,
+			   int *truemin) {
+  int nl, i, ll1=0, ll2=0;
   char *tag;
-  lmin = LM;
-  n_lmin = lmin[0].fathers_pool;
-  for (i=1; i<=n_lmin; i++) {
+  use_moves(L);
+  L->lmin = LM;
+  nl = L->lmin[0].fathers_pool;
+  for (i=1; i<=nl; i++) {
     if (truemin[i]==l1) ll1=i;
     if (truemin[i]==l2) ll2=i;
   }
-  np=0;
-  max_path=128;
-  path = (path_entry *) space(max_path*sizeof(path_entry));
+  if (ll1==0 || ll2==0) {
+    fprintf(stderr, "ERROR in backtrack_path(): no lmin %d\n",
+	    (ll1) ? l2 : l1);
+    return NULL;
+  }
+  L->np=0;
+  L->max_path=128;
+  L->path = (path_entry *) space(L->max_path*sizeof(path_entry));
   tag = (char *) space(16);
-  backtrack_path_rec(ll1, ll2, tag);  path[np].hp = NULL;
-  qsort(path, np, sizeof(path_entry), path_cmp);
+  if (backtrack_path_rec(L, ll1, ll2, tag)) {
+    free(tag);
+    free(L->path);
+    return NULL;
+  }
+  L->path[L->np].hp = NULL;
+  qsort(L->path, L->np, sizeof(path_entry), path_cmp);
   free(tag);
-  return(path);
+  return(L->path);
 }
 
-static void backtrack_path_rec (int l1, int l2, const char *tag)
+/* returns -1 if there is no path */
+static int backtrack_path_rec(landscape *L, int l1, int l2, const char *tag)
 {
-  hash_entry h, *l1dir, *l2dir;
-  int dir=1, swap=0, child, father, maxsaddle;
+  hash_entry *l1dir, *l2dir;
+  int dir=1, swap=0, child, maxsaddle;
   /* if left==1 left points toward l2 else toward l1 */
   if (l1>l2) {
     dir = -1;
     {int t; t=l1; l1=l2; l2=t;}
   }
-  child  = l2; father = l1;
 
-  maxsaddle = child;
   /* find saddle connecting l1 and l2 */
-  while (lmin[child].father != father) {
-    if (lmin[child].father == 0){
-      fprintf(stderr, "ERROR in backtrack_path(): ");
-      fprintf(stderr,"No saddle between lmin %d and lmin %d\n", l2, l1);
-      exit (1);
-    }
-    child = lmin[child].father;
-    if (child<father) {int t; t = child; child = father; father = t;}
-    if (lmin[child].E_saddle > lmin[maxsaddle].E_saddle)
-      maxsaddle = child;
-    /* fprintf(stderr,"f:>%d< c:>%d< %d\n", father, child, maxsaddle); */
+  if ((maxsaddle = tree_saddle(L, l1, l2))==0) {
+    fprintf(stderr, "ERROR in backtrack_path(): ");
+    fprintf(stderr,"No saddle between lmin %d and lmin %d\n", l2, l1);
+    return -1;
   }
   /* found the saddle point, maxsaddle, connecting l1 and l2 */
-  h.structure = lmin[maxsaddle].saddle;
-  path[np].hp = lookup_hash(&h);
-  strcpy(path[np].key,tag); strcat(path[np].key, "M");
-  np++;
+  grow_path(L);
+  L->path[L->np].hp = lookup_structure(L, L->lmin[maxsaddle].saddle);
+  strcpy(L->path[L->np].key,tag); strcat(L->path[L->np].key, "M");
+  L->np++;
 
   /* which direction from saddle to l2, l1 ? */
-  for (child=l2; child>0 ; child=lmin[child].father) {
+  for (child=l2; child>0 ; child=L->lmin[child].father) {
     if (child==maxsaddle) {
-      l2dir = lmin[maxsaddle].left;
-      l1dir = lmin[maxsaddle].right;
+      l2dir = L->lmin[maxsaddle].left;
+      l1dir = L->lmin[maxsaddle].right;
       break;
     }
-    if (child==lmin[maxsaddle].father) {
-      l2dir = lmin[maxsaddle].right;
-      l1dir = lmin[maxsaddle].left;
+    if (child==L->lmin[maxsaddle].father) {
+      l2dir = L->lmin[maxsaddle].right;
+      l1dir = L->lmin[maxsaddle].left;
       break;
     }
   }
 
   /* branch to l2,  else saddle==l2 and we're done */
-  if (l2dir)
-    walk_limb (l2dir, l2, -dir, tag);
+  if (l2dir && walk_limb(L, l2dir, l2, -dir, tag))
+    return -1;
   /* branch to l1 (to father) */
   if (l1dir) /* else saddle==l1 and we're done */
-      walk_limb (l1dir, l1, dir, tag);
+    return walk_limb(L, l1dir, l1, dir, tag);
+  return 0;
+}
+
+/* the minimum whose saddle is the highest one on the way from l2 to
+   l1<l2 in the barrier tree, 0 if they are not connected */
+static int tree_saddle(landscape *L, int l1, int l2) {
+  int child=l2, father=l1, maxsaddle=l2;
+  while (L->lmin[child].father != father) {
+    if (L->lmin[child].father == 0) return 0;
+    child = L->lmin[child].father;
+    if (child<father) {int t; t = child; child = father; father = t;}
+    if (L->lmin[child].E_saddle > L->lmin[maxsaddle].E_saddle)
+      maxsaddle = child;
+    /* fprintf(stderr,"f:>%d< c:>%d< %d\n", father, child, maxsaddle); */
+  }
+  return maxsaddle;
+}
+
+/* make room for the next path entry and the terminating one */
+static void grow_path(landscape *L) {
+  if (L->np+2>=L->max_path) {
+    L->max_path *= 2;
+    L->path = (path_entry *) xrealloc(L->path, L->max_path*sizeof(path_entry));
+  }
 }
 
 /*=======================================================================*/
-static void walk_limb (hash_entry *hp, int LM, int inc, const char *tag)
+static int walk_limb(landscape *L, hash_entry *hp, int LM, int inc,
+		     const char *tag)
 {
-  char *tmp; int num=0;
+  char *tmp; int num=0, bad=0;
   hash_entry *htmp;
 
   tmp = (char *) space(strlen(tag)+4);;
   strcpy(tmp, tag);
   strcat(tmp, (inc>0) ? "R" : "LZ");
   /* walk down until u hit a local minimum */
-  for (htmp = hp; htmp->down != NULL; htmp = htmp->down, num += inc, np++) {
-    if (np+2>=max_path) {
-      max_path *= 2;
-      path = (path_entry *) xrealloc(path, max_path*sizeof(path_entry));
-    }
-    path[np].hp = htmp;
-    strcpy(path[np].key, tmp);
-    path[np].num = num;
+  for (htmp = hp; htmp->down != NULL; htmp = htmp->down, num += inc, L->np++) {
+    grow_path(L);
+    L->path[L->np].hp = htmp;
+    strcpy(L->path[L->np].key, tmp);
+    L->path[L->np].num = num;
   }
 
   /* store local minimum (but only once) */
   if (htmp->basin == LM) {
-    path[np].hp = htmp;
-    strcpy(path[np].key, tmp);
-    path[np++].num = num;
+    grow_path(L);
+    L->path[L->np].hp = htmp;
+    strcpy(L->path[L->np].key, tmp);
+    L->path[L->np++].num = num;
   }
 
   if (inc<0) tmp[strlen(tmp)-1] = '\0';
@@ -989,34 +2595,163 @@ static void walk_limb (hash_entry *hp, int LM, int inc, const char *tag)
   /* wrong local minimum start cruising again */
   if (htmp->basin != LM) {
     if (inc == -1)
-      backtrack_path_rec (htmp->basin, LM, tmp);
+      bad = backtrack_path_rec(L, htmp->basin, LM, tmp);
     else
-      backtrack_path_rec (LM, htmp->basin, tmp);
+      bad = backtrack_path_rec(L, LM, htmp->basin, tmp);
   }
   free(tmp);
+  return bad;
+}
+
+/* --between: entry of target k if it is among the first n structures
+   flooded, NULL otherwise */
+static hash_entry *find_target(landscape *L, int k, int n) {
+  hash_entry *hp;
+  if (L->tgt_line[k])
+    return (L->tgt_line[k]<=n) ? L->hpool+L->tgt_line[k]-1 : NULL;
+  hp = lookup_structure(L, L->tgt_key[k]);
+  return (hp && hp->n<=n) ? hp : NULL;
+}
+
+/* --between: called at the end of an energy band, returns 1 once both
+   targets are among the first n structures and their basins merged */
+static int targets_merged(landscape *L, int n) {
+  hash_entry *t0, *t1;
+  if ((t0 = find_target(L, 0, n))==NULL || (t1 = find_target(L, 1, n))==NULL)
+    return 0;
+  return (find_basin(L, t0->basin) == find_basin(L, t1->basin));
+}
+
+/* --between: the saddle connecting the targets, once flooding is
+   finished; returns NULL if they weren't both read or aren't connected */
+static hash_entry *target_saddle(landscape *L, hash_entry **t) {
+  hash_entry *hi;
+  int a, b, m;
+  if ((t[0] = find_target(L, 0, L->readl))==NULL ||
+      (t[1] = find_target(L, 1, L->readl))==NULL)
+    return NULL;
+  hi = (t[0]->energy > t[1]->energy) ? t[0] : t[1];
+  a = t[0]->basin; b = t[1]->basin;
+  if (a==b) return hi;
+  m = (a<b) ? tree_saddle(L, a, b) : tree_saddle(L, b, a);
+  if (m==0) return NULL;
+  /* the path from a target into its basin never goes above it */
+  return (L->lmin[m].E_saddle > hi->energy) ?
+    lookup_structure(L, L->lmin[m].saddle) : hi;
 }
 
-void print_path(FILE *PATH, path_entry *path, int *tm) {
+/* report the saddle between the --between targets, returns -1 if one
+   of them is not in the input */
+int print_between(landscape *L, FILE *out) {
+  const char *format[2] = {"%-6s %s %13.5f\n", "%-6s %s %6.2f\n"};
+  hash_entry *t[2], *sp;
+  char *struc;
+  int k;
+
+  use_moves(L);
+  t[0] = t[1] = NULL;
+  sp = target_saddle(L, t);
+  for (k=0; k<2; k++)
+    if (t[k]==NULL)
+      return run_error(L, "--between: %s configuration not found in the"
+		       " input", (k) ? "second" : "first");
+  for (k=0; k<2; k++) {
+    struc = L->unpack_my_structure(t[k]->structure);
+    fprintf(out, format[L->IS_RNA], (k) ? "to" : "from", struc, t[k]->energy);
+    free(struc);
+  }
+  if (sp==NULL) {
+    fprintf(out, "saddle not found, targets are not connected\n");
+    return 0;
+  }
+  struc = L->unpack_my_structure(sp->structure);
+  fprintf(out, format[L->IS_RNA], "saddle", struc, sp->energy);
+  free(struc);
+  fprintf(out, (L->IS_RNA) ? "barrier %6.2f %6.2f\n" : "barrier %13.5f %13.5f\n",
+	  sp->energy - t[0]->energy, sp->energy - t[1]->energy);
+  return 0;
+}
+
+/* path from the first --between target over the saddle to the second,
+   terminated by an entry with hp==NULL */
+path_entry *between_path(landscape *L) {
+  hash_entry *t[2];
+  int i, j;
+
+  use_moves(L);
+  L->np=0;
+  L->max_path=128;
+  L->path = (path_entry *) space(L->max_path*sizeof(path_entry));
+  if (target_saddle(L, t)) {
+    /* first down from t[0] into its basin, sorts first as "AR...",
+       from there to the basin of t[1], as "B...", and up to t[1],
+       "CLZ..." with decreasing num */
+    if (walk_limb(L, t[0], t[0]->basin, 1, "A") ||
+	(t[0]->basin!=t[1]->basin &&
+	 backtrack_path_rec(L, t[1]->basin, t[0]->basin, "B")) ||
+	walk_limb(L, t[1], t[1]->basin, -1, "C")) {
+      free(L->path);
+      return NULL;
+    }
+  }
+  qsort(L->path, L->np, sizeof(path_entry), path_cmp);
+  /* the minima joining the pieces appear twice */
+  for (i=j=0; i<L->np; i++)
+    if (j==0 || L->path[i].hp!=L->path[j-1].hp)
+      L->path[j++] = L->path[i];
+  L->path[j].hp = NULL;
+  return(L->path);
+}
+
+void print_path(landscape *L, FILE *PATH, path_entry *pe, int *tm) {
   int i;
-  for (i=0; path[i].hp; i++) {
+  use_moves(L);
+  for (i=0; pe[i].hp; i++) {
     char c[6] = {0,0,0,0}, *struc;
-    if (path[i].hp->down==NULL) {
-      sprintf(c, "L%04d", tm[path[i].hp->basin]);
+    if (pe[i].hp->down==NULL) {
+      sprintf(c, "L%04d", (tm) ? tm[pe[i].hp->basin] : pe[i].hp->basin);
     } else
-      if (path[i].key[strlen(path[i].key)-1] == 'M')
+      if (pe[i].key[strlen(pe[i].key)-1] == 'M')
 	c[0] = 'S';
       else c[0] = 'I';
-    struc = unpack_my_structure(path[i].hp->structure);
-    fprintf(PATH, "%s (%6.2f) %-5s\n", struc,  path[i].hp->energy, c);
+    struc = L->unpack_my_structure(pe[i].hp->structure);
+    fprintf(PATH, "%s (%6.2f) %-5s\n", struc,  pe[i].hp->energy, c);
     free(struc);
   }
 }
 
-static void merge_components(int c1, int c2) {
-  if (comp[c1].size<comp[c2].size) {int cc; cc=c1; c1=c2; c2=cc;}
-  comp[c1].size += comp[c2].size;
-  truecomp[c2]=c1;
-  set_merge(comp[c1].basins, comp[c2].basins);
+/* deepest local minimum the basin of b has been merged into, i.e. the
+   root of b in the barrier tree built so far */
+static int find_basin(landscape *L, int b) {
+  int r, t;
+  for (r=b; L->uf[r]!=r; r=L->uf[r]);
+  while (L->uf[b]!=r) { t=L->uf[b]; L->uf[b]=r; b=t; }
+  return r;
+}
+
+/* connected component c has been merged into (this energy band) */
+static int find_comp(landscape *L, int c) {
+  int r, t;
+  for (r=c; L->truecomp[r]!=r; r=L->truecomp[r]);
+  while (L->truecomp[c]!=r) { t=L->truecomp[c]; L->truecomp[c]=r; c=t; }
+  return r;
+}
+
+/* join the components with roots c1 and c2, returns the new root;
+   the saddle of the one with more structures is kept */
+static int merge_components(landscape *L, int c1, int c2) {
+  struct comp *a = L->comp+c1, *b = L->comp+c2;
+  char *saddle;
+  int t;
+  saddle = (a->size<b->size) ? b->saddle : a->saddle;
+  if (a->rank<b->rank) {t=c1; c1=c2; c2=t; a=L->comp+c1; b=L->comp+c2;}
+  else if (a->rank==b->rank) a->rank++;
+  L->truecomp[c2] = c1;
+  a->saddle = saddle;
+  a->size += b->size;
+  if (b->first<a->first) a->first = b->first;
+  t = a->next; a->next = b->next; b->next = t;  /* splice the lists */
+  return c1;
 }
 
 static int comp_comps(const void *A, const void *B) {
@@ -1028,6 +2763,8 @@ static int comp_comps(const void *A, const void *B) {
     r = a->basins->data[i].basin - b->basins->data[i].basin;
     if (r!=0) return r;
   }
+  if (a->basins->num_elem==b->basins->num_elem)
+    return a->first - b->first;
   return (i==a->basins->num_elem)? -1:1;
 }
 
@@ -1038,126 +2775,528 @@ static void print_hash_entry(hash_entry *h) {
 	 h->energy, h->basin, h->GradientBasin, h->ccomp, down);
 }
 
-void print_rates(int n, char *fname) {
+/* with --sparse-rates, rates.bin holds the matrix in compressed sparse
+   rows in the format of --edges files: n and the number of entries m
+   as 64-bit integers, n+1 64-bit row offsets and m 32-bit column
+   indices, all counting from 0, followed by the m rates as doubles */
+static void print_sparse_rates(landscape *L, FILE *OUT, FILE *BINOUT) {
+  rate_matrix *m = L->rate;
+  unsigned long long head[2], k, *off;
+  unsigned long *keys;
+  unsigned int col;
+  int i;
+
+  keys = sorted_rates(m);
+  fprintf(OUT, "%%%%MatrixMarket matrix coordinate real general\n");
+  fprintf(OUT, "%d %d %lu\n", m->n, m->n, m->used);
+  for (k=0; k<m->used; k++)
+    fprintf(OUT, "%d %d %10.4g\n", (int) (keys[k]/(m->n+1)),
+	    (int) (keys[k]%(m->n+1)), *rate_slot(m, keys[k]));
+  head[0] = m->n; head[1] = m->used;
+  off = (unsigned long long *) space((m->n+1)*sizeof(unsigned long long));
+  for (k=0; k<m->used; k++) off[keys[k]/(m->n+1)]++;  /* rows count from 1 */
+  for (i=1; i<=m->n; i++) off[i] += off[i-1];
+  fwrite(head, sizeof(unsigned long long), 2, BINOUT);
+  fwrite(off, sizeof(unsigned long long), m->n+1, BINOUT);
+  for (k=0; k<m->used; k++) {
+    col = keys[k]%(m->n+1) - 1;
+    fwrite(&col, sizeof(unsigned int), 1, BINOUT);
+  }
+  for (k=0; k<m->used; k++)
+    fwrite(rate_slot(m, keys[k]), sizeof(double), 1, BINOUT);
+  free(off);
+  free(keys);
+}
+
+void print_rates(landscape *L, int n, char *fname) {
   int i,j;
   FILE *OUT;
-#define BINRATES
-#ifdef BINRATES
   FILE *BINOUT;
-  char *binfile = "rates.bin";
-  double tmprate;
+  char *binfile;
+  double *col;
+
+  use_moves(L);
+  binfile = out_name(L, "rates.bin");
   BINOUT = fopen(binfile, "w");
   if (!BINOUT){
     fprintf(stderr, "could not open file pointer 4 binary outfile\n");
-    exit(101);
-  }
-  /* first write dim to file */
-  fwrite(&n,sizeof(int),1,BINOUT);
-  for(i=1;i<=n;i++)
-    for(j=1;j<=n;j++){
-      tmprate = rate[j][i];
-      fwrite(&tmprate,sizeof(double),1,BINOUT);
-    }
-  fprintf(stderr, "rate matrix written to binfile\n");
-  fclose(BINOUT);
-#endif
-
+    free(binfile);
+    return;
+  }
+  free(binfile);
+  fname = out_name(L, fname);
   OUT = fopen(fname, "w");
   if (!OUT) {
     fprintf(stderr, "could not open rates file %s for output\n", fname);
+    free(fname);
+    fclose(BINOUT);
     return;
   }
+  free(fname);
 
-  for (i=1; i<=n; i++) {
-    for (j=1; j<=n; j++)
-      fprintf(OUT, "%10.4g ", rate[i][j]);
-    fprintf(OUT, "\n");
-    free(rate[i]);
+  if (L->rate->dense==NULL) print_sparse_rates(L, OUT, BINOUT);
+  else {
+    double **rate = L->rate->dense;
+    /* first write dim to file, then the matrix column by column */
+    fwrite(&n,sizeof(int),1,BINOUT);
+    col = (double *) space((n+1)*sizeof(double));
+    for(i=1;i<=n;i++) {
+      for(j=1;j<=n;j++) col[j] = rate[j][i];
+      fwrite(col+1, sizeof(double), n, BINOUT);
+    }
+    free(col);
+    for (i=1; i<=n; i++) {
+      for (j=1; j<=n; j++)
+	fprintf(OUT, "%10.4g ", rate[i][j]);
+      fprintf(OUT, "\n");
+    }
   }
-  free(rate);
+  fprintf(stderr, "rate matrix written to binfile\n");
+  fclose(BINOUT);
   fclose(OUT);
+  free_rates(L->rate);
+  L->rate = NULL;
+}
+
+static rate_matrix *new_rates(int n, int sparse) {
+  rate_matrix *m;
+  int i;
+  m = (rate_matrix *) space(sizeof(rate_matrix));
+  m->n = n;
+  if (sparse) {
+    m->size = 1024;
+    m->key = (unsigned long *) space(m->size*sizeof(unsigned long));
+    m->val = (double *) space(m->size*sizeof(double));
+  }
+  else {
+    m->dense = (double **) space((n+1)*sizeof(double *));
+    for (i=1; i<=n; i++) m->dense[i] = (double *) space((n+1)*sizeof(double));
+  }
+  return m;
+}
+
+static void free_rates(rate_matrix *m) {
+  int i;
+  if (m==NULL) return;
+  if (m->dense) {
+    for (i=1; i<=m->n; i++) free(m->dense[i]);
+    free(m->dense);
+  }
+  free(m->key);
+  free(m->val);
+  free(m);
 }
 
-void compute_rates(int *truemin, char *farbe) {
-  int i, j, ii, r, gb, gradmin,n, rc, *realnr;
-  char *p, *pp, *form, newsub[10]="new.sub", mr[15]="microrates.out";
-  hash_entry *hpr, h, *hp;
+/* slot of key k in the sparse matrix m, empty if k isn't there */
+static unsigned long rate_hash(rate_matrix *m, unsigned long k) {
+  unsigned long h;
+  h = (unsigned long) ((k * 0x9E3779B97F4A7C15ULL) >> 20) & (m->size-1);
+  while (m->key[h] && m->key[h]!=k) h = (h+1) & (m->size-1);
+  return h;
+}
+
+static double *rate_slot(rate_matrix *m, unsigned long k) {
+  unsigned long h, i;
+  h = rate_hash(m, k);
+  if (m->key[h]) return m->val+h;
+  if (2*(m->used+1)>m->size) {
+    /* keep the table at most half full */
+    unsigned long *okey = m->key, osize = m->size;
+    double *oval = m->val;
+    m->size *= 2;
+    m->key = (unsigned long *) space(m->size*sizeof(unsigned long));
+    m->val = (double *) space(m->size*sizeof(double));
+    for (i=0; i<osize; i++)
+      if (okey[i]) {
+	h = rate_hash(m, okey[i]);
+	m->key[h] = okey[i];
+	m->val[h] = oval[i];
+      }
+    free(okey); free(oval);
+    h = rate_hash(m, k);
+  }
+  m->key[h] = k;
+  m->used++;
+  return m->val+h;
+}
+
+/* entry i,j of m, made if needed */
+static double *rate_at(rate_matrix *m, int i, int j) {
+  if (m->dense) return m->dense[i]+j;
+  return rate_slot(m, (unsigned long) i*(m->n+1)+j);
+}
+
+static double get_rate(rate_matrix *m, int i, int j) {
+  unsigned long h;
+  if (m->dense) return m->dense[i][j];
+  h = rate_hash(m, (unsigned long) i*(m->n+1)+j);
+  return (m->key[h]) ? m->val[h] : 0.;
+}
+
+/* add the entries of b to those of a */
+static void add_rate_matrix(rate_matrix *a, rate_matrix *b) {
+  unsigned long h;
+  int i, j;
+  if (b->dense) {
+    for (i=1; i<=b->n; i++)
+      for (j=1; j<=b->n; j++) a->dense[i][j] += b->dense[i][j];
+    return;
+  }
+  for (h=0; h<b->size; h++)
+    if (b->key[h]) *rate_slot(a, b->key[h]) += b->val[h];
+}
+
+static int comp_keys(const void *a, const void *b) {
+  unsigned long A = *(const unsigned long *) a, B = *(const unsigned long *) b;
+  return (A>B) - (A<B);
+}
+
+/* keys of the entries of the sparse matrix m, i.e. row by row */
+static unsigned long *sorted_rates(rate_matrix *m) {
+  unsigned long *keys, h, k;
+  keys = (unsigned long *) space((m->used+1)*sizeof(unsigned long));
+  for (h=k=0; h<m->size; h++)
+    if (m->key[h]) keys[k++] = m->key[h];
+  qsort(keys, m->used, sizeof(unsigned long), comp_keys);
+  return keys;
+}
+
+/* set up w for rates between the macro states 1..n */
+static void new_rate_worker(landscape *L, rate_worker *w, int n,
+			    int own_rates) {
+  memset(w, 0, sizeof(rate_worker));
+  w->dr = (double *) space((n+1)*sizeof(double));
+  w->gb = (int *) space((n+1)*sizeof(int));
+  w->seen = (int *) space((n+1)*sizeof(int));
+  if (own_rates) w->rate = new_rates(n, L->opt.sparse_rates);
+  w->ls = L;
+}
+
+static void free_rate_worker(rate_worker *w) {
+  free_rates(w->rate);
+  free(w->dr); free(w->gb); free(w->seen);
+  free(w->ec.buf);
+}
+
+/* find the neighbors of structure r that come before it, they are left
+   in hits, and what r sends to each macro state tmin[] up to n.
+   Returns r's own macro state, the rest is skipped if that is > n. */
+static int rate_structure(landscape *L, rate_worker *w, int r, int *tmin,
+			  int n, int *nh) {
+  hash_entry *hpr = L->hpool+r, *hp;
+  int j, g, gb, cached;
   double Zi;
-  FILE *NEWSUB=NULL, *MR=NULL;;
 
+  /* the stored edges are read in sequence, skip none */
+  cached = (L->cache_edges && r>=L->edge_base);
+  if (cached) *nh = cached_neighbors(L, r, &w->ec);
+  w->n_gb = 0;
+  g = tmin[hpr->GradientBasin];
+  if (g>n) return g;
+  if (!cached) {
+    char *cform = L->unpack_my_structure(hpr->structure);
+    *nh = L->find_neighbors(L, cform, hpr->structure);
+    free(cform);
+  }
+  Zi = exp((L->mfe-hpr->energy)/L->kT);
+  for (j=0; j<*nh; j++) {
+    hp = hits[j];
+    if (hp->n>r) continue;
+    gb = tmin[hp->GradientBasin];
+    if (gb>n) continue;
+    if (w->seen[gb]!=r+1) {
+      w->seen[gb] = r+1;
+      w->dr[gb] = 0;
+      w->gb[w->n_gb++] = gb;
+    }
+    w->dr[gb] += Zi;
+  }
+  return g;
+}
+
+/* add what the last structure, of macro state g, sends to rate */
+static void add_rates(rate_matrix *rate, rate_worker *w, int g) {
+  int k, i;
+  for (k=0; k<w->n_gb; k++) {
+    i = w->gb[k];
+    *rate_at(rate, i, g) += w->dr[i];
+    *rate_at(rate, g, i) += w->dr[i];
+  }
+}
+
+#if HAVE_PTHREAD
+/* With --threads the structures are handed out to the threads in
+   chunks of RATE_CHUNK. Each thread adds up the rates of its chunks in
+   a matrix of its own, and these are summed at the end, so the last
+   digits may change from run to run. With --ordered-rates the threads
+   instead keep the terms of each structure of a window of chunks,
+   which are then added in input order exactly as by a single thread.
+   The threads wait for the next window like those of start_lookups(). */
+typedef struct {
+  int g, gb;
+  double dr;
+} rate_term;
+
+typedef struct rate_job {
+  int *tmin, n;
+  int chunk, first, end;     /* next chunk, chunks of this window */
+  unsigned long *chunk_edge; /* first stored edge of each chunk */
+  rate_term **terms;         /* with --ordered-rates, per chunk */
+  int *n_terms, *max_terms;
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  int round, busy, quit;
+} rate_job;
+
+static void rate_chunks(landscape *L, rate_worker *w) {
+  rate_job *job = w->job;
+  int c, r, e, g, j, k, nh=0;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    c = job->chunk++;
+    pthread_mutex_unlock(&job->lock);
+    if (c>=job->end) break;
+    if (L->cache_edges) seek_edges(&w->ec, job->chunk_edge[c]);
+    k = c - job->first;
+    if (job->terms) job->n_terms[k] = 0;
+    r = c*RATE_CHUNK;
+    for (e = (r+RATE_CHUNK<L->readl) ? r+RATE_CHUNK : L->readl; r<e; r++) {
+      g = rate_structure(L, w, r, job->tmin, job->n, &nh);
+      if (g>job->n) continue;
+      if (w->rate) {
+	add_rates(w->rate, w, g);
+	continue;
+      }
+      if (job->n_terms[k]+w->n_gb>job->max_terms[k]) {
+	job->max_terms[k] = 2*job->max_terms[k] + w->n_gb + 64;
+	job->terms[k] = (rate_term *)
+	  xrealloc(job->terms[k], job->max_terms[k]*sizeof(rate_term));
+      }
+      for (j=0; j<w->n_gb; j++) {
+	rate_term *t = job->terms[k] + job->n_terms[k]++;
+	t->g = g; t->gb = w->gb[j]; t->dr = w->dr[t->gb];
+      }
+    }
+  }
+}
+
+static void *rate_thread(void *arg) {
+  rate_worker *w = (rate_worker *) arg;
+  rate_job *job = w->job;
+  int round=0;
+  use_moves(w->ls);
+  pthread_mutex_lock(&job->lock);
+  for (;;) {
+    while (round==job->round && !job->quit)
+      pthread_cond_wait(&job->start, &job->lock);
+    if (job->quit) break;
+    round = job->round;
+    pthread_mutex_unlock(&job->lock);
+    rate_chunks(w->ls, w);
+    pthread_mutex_lock(&job->lock);
+    if (--job->busy==0) pthread_cond_signal(&job->done);
+  }
+  pthread_mutex_unlock(&job->lock);
+  free_stapel();
+  free(hits); hits = NULL; max_hits = 0;
+  free(batch_keys); batch_keys = NULL; max_batch_keys = 0;
+  free_move_buffers();
+  RNA_free_thread();
+  return NULL;
+}
+
+/* the second pass of compute_rates() on nt threads, returns -1 if the
+   edge file can't be read */
+static int thread_rates(landscape *L, int *tmin, int n, int nt) {
+  rate_job job;
+  rate_worker *w;
+  pthread_t *tid;
+  int c, i, k, t, n_chunks, win, nc, bad=0;
+
+  memset(&job, 0, sizeof(job));
+  job.tmin = tmin; job.n = n;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.start, NULL);
+  pthread_cond_init(&job.done, NULL);
+  n_chunks = (L->readl+RATE_CHUNK-1)/RATE_CHUNK;
+  if (L->cache_edges) {
+    unsigned long e=0;
+    job.chunk_edge = (unsigned long *) space((n_chunks+1)*sizeof(unsigned long));
+    for (c=0; c<n_chunks; c++) {
+      job.chunk_edge[c] = e;
+      for (i=c*RATE_CHUNK; i<(c+1)*RATE_CHUNK && i<L->readl; i++)
+	if (i>=L->edge_base) e += L->edge_n[i-L->edge_base];
+    }
+  }
+  win = n_chunks;
+  if (L->opt.ordered_rates) {
+    win = 4*nt;
+    job.terms = (rate_term **) space(win*sizeof(rate_term *));
+    job.n_terms = (int *) space(win*sizeof(int));
+    job.max_terms = (int *) space(win*sizeof(int));
+  }
+  w = (rate_worker *) space(nt*sizeof(rate_worker));
+  tid = (pthread_t *) space(nt*sizeof(pthread_t));
+  for (t=0; t<nt; t++) {
+    new_rate_worker(L, w+t, n, t>0 && !job.terms);
+    w[t].job = &job;
+    if (L->edge_fp && !(w[t].ec.fp = fopen(L->edge_name, "rb")))
+      bad = 1;
+  }
+  /* the calling thread sums straight into L->rate */
+  if (!job.terms) w[0].rate = L->rate;
+  /* without a thread its chunks are left to the others */
+  for (nc=1; !bad && nc<nt; nc++)
+    if (pthread_create(tid+nc, NULL, rate_thread, w+nc)) break;
+
+  for (job.first=0; !bad && job.first<n_chunks; job.first+=win) {
+    pthread_mutex_lock(&job.lock);
+    job.chunk = job.first;
+    job.end = (job.first+win<n_chunks) ? job.first+win : n_chunks;
+    job.busy = nc-1;
+    job.round++;
+    pthread_cond_broadcast(&job.start);
+    pthread_mutex_unlock(&job.lock);
+    rate_chunks(L, w);
+    pthread_mutex_lock(&job.lock);
+    while (job.busy) pthread_cond_wait(&job.done, &job.lock);
+    pthread_mutex_unlock(&job.lock);
+    for (k=0; job.terms && k<job.end-job.first; k++)
+      for (i=0; i<job.n_terms[k]; i++) {
+	rate_term *r = job.terms[k]+i;
+	*rate_at(L->rate, r->gb, r->g) += r->dr;
+	*rate_at(L->rate, r->g, r->gb) += r->dr;
+      }
+  }
+  pthread_mutex_lock(&job.lock);
+  job.quit = 1;
+  pthread_cond_broadcast(&job.start);
+  pthread_mutex_unlock(&job.lock);
+  for (t=1; t<nc; t++) pthread_join(tid[t], NULL);
+
+  for (t=0; t<nt; t++) {
+    if (w[t].rate && t>0) add_rate_matrix(L->rate, w[t].rate);
+    if (t==0) w[0].rate = NULL;
+    if (w[t].ec.fp) fclose(w[t].ec.fp);
+    if (w[t].ec.failed) bad = 1;
+    free_rate_worker(w+t);
+  }
+  for (k=0; job.terms && k<win; k++) free(job.terms[k]);
+  free(job.terms); free(job.n_terms); free(job.max_terms);
+  free(job.chunk_edge);
+  pthread_mutex_destroy(&job.lock);
+  pthread_cond_destroy(&job.start);
+  pthread_cond_destroy(&job.done);
+  free(w); free(tid);
+  return (bad) ? -1 : 0;
+}
+#endif
+
+/* rates between the true minima, left for print_rates(); returns -1
+   if the edges kept by --cache-edges can't be read back */
+int compute_rates(landscape *L, int *truemin, char *farbe) {
+  int i, j, ii, r, gradmin, n, nt, rc, nh=0, *realnr, *tmin, bad=0;
+  double *zg;
+  char *cform, *newsub, *mr;
+  hash_entry *hpr, *hp;
+  FILE *NEWSUB=NULL, *MR=NULL;
+  rate_worker w;
+
+  use_moves(L);
   n = truemin[0];
-  rate = (double **) space((n + 1) * sizeof(double *));
-  dr   = (double  *) space((n + 1) * sizeof(double));
-  for (i=1; i<=n; i++)
-    rate[i] = (double *) space((n + 1) * sizeof(double));
-  if(do_microrates){
-    realnr = (int *)space((readl+1) * sizeof(int));
+  L->rate = new_rates(n, L->opt.sparse_rates);
+  zg = (double *) space((n+1)*sizeof(double));
+  /* macro state of each gradient basin: the first ancestor that is a
+     true minimum (fathers have smaller indices than their children) */
+  tmin = (int *) space((L->n_lmin+1) * sizeof(int));
+  tmin[0] = truemin[0];
+  for (i=1; i<=L->n_lmin; i++)
+    tmin[i] = (truemin[i]) ? truemin[i] : tmin[L->lmin[i].father];
+  if (L->edge_fp && (fflush(L->edge_fp) || fseek(L->edge_fp, 0, SEEK_SET)))
+    bad = 1;
+
+  /* microrates are written in input order */
+  nt = (L->do_microrates) ? 1 : L->opt.threads;
+  if (nt>1 && !threads_ok(L) && !(L->cache_edges && L->edge_base==0))
+    nt = 1;
+  if (bad) nt = 0;
+#if HAVE_PTHREAD
+  if (nt>1) {
+    bad = thread_rates(L, tmin, n, nt);
+    nt = 0;
+  }
+#endif
+  if(nt && L->do_microrates){
+    newsub = out_name(L, "new.sub");
+    mr = out_name(L, "microrates.out");
+    realnr = (int *)space((L->readl+1) * sizeof(int));
     MR = fopen(mr, "w");
     NEWSUB = fopen(newsub, "w");
-    fprintf(NEWSUB, "%s %6.2f\n", farbe, 100*mfe);
+    free(mr); free(newsub);
+    fprintf(NEWSUB, "%s %6.2f\n", farbe, 100*L->mfe);
     fflush(NEWSUB);
-    fprintf(MR, ">%d states\n", readl);
+    fprintf(MR, ">%d states\n", L->readl);
+  }
+  if (nt) {
+    new_rate_worker(L, &w, n, 0);
+    w.ec.fp = L->edge_fp;
   }
 
-  for (rc=1, r=0; r<readl; r++) {
-    int b;
-    hpr= &hpool[r];
-    gradmin = hpr->GradientBasin;
-    Zi = exp((mfe-hpr->energy)/kT);
-    while (truemin[gradmin]==0) gradmin = lmin[gradmin].father;
-    gradmin=truemin[gradmin];
+  for (rc=1, r=0; nt && r<L->readl && !w.ec.failed; r++) {
+    hpr= &L->hpool[r];
+    gradmin = rate_structure(L, &w, r, tmin, n, &nh);
     if (gradmin>n) continue;
-    for (b=hpr->basin; b>1; b=lmin[b].father);
-    form = unpack_my_structure(hpr->structure);
-    move_it(form);       /* generate all neighbors of configuration */
-
-    for (i=0; i<=n; i++) dr[i]=0;
-    while ((p = pop())) {
-      pp = pack_my_structure(p);
-      h.structure = pp;
-      /* check whether we've seen the structure before */
-      if ((hp = lookup_hash(&h)))
-	if (hp->n<=r) {
-	  gb = hp->GradientBasin;
-	  while (truemin[gb]==0) gb = lmin[gb].father;
-	  gb = truemin[gb];
-	  if (gb<=n) dr[gb] += Zi;
-	  if (do_microrates && b) {
-	    double rate,dg;
-	    dg = hpr->energy - hp->energy;
-	    rate = exp(-dg/kT);
-	    fprintf(MR,"%10d %8d %15.12f 1\n",rc,realnr[hp->n],rate);
-	  }
-	}
-      free(pp);
-    }
-    if (do_microrates && b){
-      fprintf(NEWSUB, "%s %6.2f %i %i\n", form, hpr->energy, gradmin, hpr->basin);
+    if (L->do_microrates && find_basin(L, hpr->basin)==1) {
+      /* hits still holds the neighbors of hpr */
+      for (j=0; j<nh; j++) {
+	double mrate,dg;
+	hp = hits[j];
+	if (hp->n>r) continue;
+	dg = hpr->energy - hp->energy;
+	mrate = exp(-dg/L->kT);
+	fprintf(MR,"%10d %8d %15.12f 1\n",rc,realnr[hp->n],mrate);
+      }
+      cform = L->unpack_my_structure(hpr->structure);
+      fprintf(NEWSUB, "%s %6.2f %i %i\n", cform, hpr->energy, gradmin, hpr->basin);
       fflush(NEWSUB);
+      free(cform);
       realnr[hpr->n]=rc++;
     }
-    for (i=1; i<=n; i++) {
-      rate[i][gradmin] += dr[i];
-      rate[gradmin][i] += dr[i];
-    }
-    free(form);
-    reset_stapel();
+    add_rates(L->rate, &w, gradmin);
+  }
+  if (nt) {
+    bad = w.ec.failed;
+    w.ec.fp = NULL;   /* L->edge_fp is closed by end_run() */
+    free_rate_worker(&w);
   }
 
+  if (L->cache_edges && L->verbose)
+    fprintf(stderr, "rates from %lu cached edges\n", L->n_edges);
   fprintf(stderr, "done with 2nd pass\n" );
-  free(dr);
+  free(tmin);
 
   for (i=ii=1; i<=n; i++, ii++) {
     while (truemin[ii]!=i) ii++;
-    for (j=1; j<=n; j++)
-      rate[i][j] /= lmin[ii].Zg;
+    if (L->rate->dense)
+      for (j=1; j<=n; j++) L->rate->dense[i][j] /= L->lmin[ii].Zg;
+    else zg[i] = L->lmin[ii].Zg;
   }
-  if(do_microrates){
+  if (!L->rate->dense) {
+    unsigned long h;
+    for (h=0; h<L->rate->size; h++)
+      if (L->rate->key[h])
+	L->rate->val[h] /= zg[L->rate->key[h]/(n+1)];
+  }
+  free(zg);
+  if(nt && L->do_microrates){
     free(realnr);
     fclose(NEWSUB);
     fclose(MR);
   }
-  if (free_move_it)
-    free_move_it();
-  free_stapel();
+  if (bad) {
+    free_rates(L->rate);
+    L->rate = NULL;
+    return run_error(L, "can't read edge file");
+  }
+  return 0;
 }
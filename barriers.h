@@ -1,9 +1,42 @@
-extern int      *make_truemin(loc_min *Lmin);
-extern loc_min  *barriers(barrier_options opt);
-extern void print_results(loc_min *LM, int *tm, char *farbe);
-extern void ps_tree(loc_min *LM, int *tm, int rates);
-extern path_entry *backtrack_path(int l1, int l2, loc_min *LM, int *truemin);
-extern void print_path(FILE *PATH, path_entry *path, int *tm);
-extern void mark_global(loc_min *Lmin);
-extern void compute_rates(int *truemin, char *farbe);
-extern void print_rates(int n, char *fname);
+/* barriers.h */
+/* flooding energy landscapes, see main.c for an example */
+
+#ifndef _barriers_h
+#define _barriers_h
+
+#include <stdio.h>
+#include "barrier_types.h"
+
+/* all state of one flooding run, several may be open at a time, also
+   in one thread. Errors are reported on stderr: barriers_open() and
+   barriers_reopen() then return NULL, the other barriers_*() functions
+   -1 or NULL, and the landscape is only good for barriers_reopen() and
+   barriers_close(); so does compute_rates() returning -1.
+   backtrack_path() and between_path() return NULL if the minima are
+   not connected. Running out of memory still ends the program. */
+typedef struct landscape landscape;
+
+extern landscape *barriers_open(barrier_options opt);
+extern landscape *barriers_reopen(landscape *ls, barrier_options opt);
+extern int barriers_read(landscape *ls);
+extern int barriers_feed(landscape *ls, const char *conf, double en,
+			 const int *pov);
+extern loc_min *barriers_finish(landscape *ls);
+extern void barriers_close(landscape *ls);
+
+extern int      *make_truemin(landscape *ls, loc_min *Lmin);
+extern void print_results(landscape *ls, FILE *out, loc_min *LM, int *tm,
+			  char *farbe);
+extern void print_minima(landscape *ls, FILE *out, loc_min *LM, int *tm,
+			 char *farbe);
+extern void ps_tree(landscape *ls, loc_min *LM, int *tm, int rates);
+extern path_entry *backtrack_path(landscape *ls, int l1, int l2, loc_min *LM,
+				  int *truemin);
+extern void print_path(landscape *ls, FILE *PATH, path_entry *path, int *tm);
+extern int print_between(landscape *ls, FILE *out);
+extern path_entry *between_path(landscape *ls);
+extern void mark_global(landscape *ls, loc_min *Lmin);
+extern int compute_rates(landscape *ls, int *truemin, char *farbe);
+extern void print_rates(landscape *ls, int n, char *fname);
+
+#endif
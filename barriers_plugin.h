@@ -0,0 +1,51 @@
+/* barriers_plugin.h */
+/* Interface for move sets loaded at run time (barriers --plugin=FILE) */
+
+#ifndef _barriers_plugin_h
+#define _barriers_plugin_h
+
+/* bump whenever barriers_moveset changes incompatibly */
+#define BARRIERS_PLUGIN_ABI 1
+
+/*
+ * A plugin is a shared object exporting the function
+ *
+ *   const barriers_moveset *barriers_moveset_entry(void);
+ *
+ * Configurations are handled as strings: the first word of each input
+ * line is converted by pack() into the key used for hashing and
+ * storage, unpack() turns keys back into the form used for output.
+ * Keys must be NUL terminated strings without embedded NULs.
+ */
+typedef struct barriers_moveset {
+  int abi_version;     /* must be BARRIERS_PLUGIN_ABI */
+  const char *name;    /* shown with --verbose */
+
+  /* called once before the input is read with the -G and -M
+     arguments and the first word of the input header line;
+     return 0 on success.  May be NULL. */
+  int (*init)(const char *graph, const char *moveset, const char *seq);
+
+  /* generate all neighbors of configuration x, handing each one to
+     emit(), which copies it.  x and the neighbors are packed keys if
+     packed_moves is set, otherwise they are in input format. */
+  void (*neighbors)(const char *x, void (*emit)(char *));
+
+  /* malloc()ed key of / readable string for a configuration.
+     NULL means the configuration is its own key (strdup).  pack()
+     returns NULL, after saying why on stderr, if x is not a valid
+     configuration; an invalid input line stops the run, an invalid
+     neighbor is skipped. */
+  char *(*pack)(const char *x);
+  char *(*unpack)(const char *key);
+
+  int packed_moves;    /* neighbors() works on packed keys */
+  int max_degree;      /* upper bound on the number of neighbors, or 0 */
+  int key_length;      /* upper bound on the length of keys, or 0 */
+
+  void (*cleanup)(void);   /* release move set memory.  May be NULL. */
+} barriers_moveset;
+
+#endif
+
+/* End of file */
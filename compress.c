@@ -4,40 +4,38 @@
 #include "barrier_types.h"
 #include "compress.h"
 #include "utils.h"
+#include "moves.h"
 
-static int  ratio;
-static char *alphabet;
-static int  alphabet_size = -1;
-static int  orig_stringlength = -1;
 
 void ini_pack_em(barrier_options opt){
   /* 7:1 compression using base 2 encoding */
   /* 5:1 compression using base 3 encoding */
   /* 3:1 compression using base 4, 5 or 6 encoding */
-  alphabet = (char *) space(strlen(opt.GRAPH)*sizeof(char));
-  if(sscanf(opt.GRAPH, "Q%d,%s", &alphabet_size, alphabet) != 2){
+  free(MC->em_alphabet);
+  MC->em_alphabet = (char *) space(strlen(opt.GRAPH)*sizeof(char));
+  if(sscanf(opt.GRAPH, "Q%d,%s", &MC->em_alphasize, MC->em_alphabet) != 2){
     fprintf(stderr, "error in opt.GRAPH\n");
     exit(777);
   }
-  if(alphabet_size != strlen(alphabet))
+  if(MC->em_alphasize != strlen(MC->em_alphabet))
     fprintf(stderr, "wrong alphabet size\n");
-  orig_stringlength = strlen(opt.seq);
+  MC->em_length = strlen(opt.seq);
      
-  switch (alphabet_size){
+  switch (MC->em_alphasize){
   case 2:
-    ratio = 7;
+    MC->em_ratio = 7;
     break;
   case 3:
-    ratio = 5;
+    MC->em_ratio = 5;
     break;
   case 4:
-    ratio = 3;
+    MC->em_ratio = 3;
     break;
   case 5:
-    ratio = 3;
+    MC->em_ratio = 3;
     break;
   case 6:
-    ratio = 3;
+    MC->em_ratio = 3;
     break;
   default:
     fprintf(stderr, "Alphabet size neither 3, 4, 5 or 6\n");
@@ -50,9 +48,9 @@ int letter2num(char c){
   /*  F  L  R  U  X  Y */
   /*  0  1  2  3  4  5 */
   if(c == '\0') return 0;
-  pos = strchr(alphabet, c);
+  pos = strchr(MC->em_alphabet, c);
   if (pos==NULL) fprintf(stderr,"error in string\n");
-  return (int) (pos-alphabet);
+  return (int) (pos-MC->em_alphabet);
   /* attenetion: the first 3 chars of opt.GRAPH are Q<number>, */
   /* so do net use the characters 'Q', ',', and any number in your alphabet */
 }
@@ -62,14 +60,15 @@ char *pack_em(const char *string){
   unsigned char *packed;
   
   l = strlen(string);
-  orig_stringlength = l;
-  packed = (unsigned char *) calloc(1,((l+ratio-1)/ratio+1)*sizeof(unsigned char));
+  if (l != MC->em_length)  /* don't write shared state needlessly */
+    MC->em_length = l;
+  packed = (unsigned char *) calloc(1,((l+MC->em_ratio-1)/MC->em_ratio+1)*sizeof(unsigned char));
   
   j=i=pi=0; 
   while (i<l){
     register unsigned char p;
-    for(p=pi=0; pi<ratio; pi++){
-      p *= alphabet_size;  /* alphabet_size == base */
+    for(p=pi=0; pi<MC->em_ratio; pi++){
+      p *= MC->em_alphasize;  /* alphabet_size == base */
       p += letter2num(string[i]);
       if (i<l) i++;
     }
@@ -86,7 +85,7 @@ char *unpack_em(const char *packed){
   
   l = strlen(packed);
   pp = (unsigned char *) packed;
-  struc = (char *) calloc(1,(l*ratio+1)*sizeof(char)); 
+  struc = (char *) calloc(1,(l*MC->em_ratio+1)*sizeof(char)); 
   
   j=0;
   for(i=j=0; i<l; i++){
@@ -94,15 +93,15 @@ char *unpack_em(const char *packed){
     int k,c;
     
     p = pp[i]-1;
-    for(k=(ratio-1); k>=0; k--){
-      c = p % alphabet_size;
-      p /= alphabet_size;
-      struc[j+k] = alphabet[c];
+    for(k=(MC->em_ratio-1); k>=0; k--){
+      c = p % MC->em_alphasize;
+      p /= MC->em_alphasize;
+      struc[j+k] = MC->em_alphabet[c];
     }
-    j += ratio;
+    j += MC->em_ratio;
   }
   
-  while(j >= orig_stringlength)
+  while(j >= MC->em_length)
     struc[j--] = '\0';
   
   return struc;
@@ -17,11 +17,14 @@ static char UNUSED rcsid[] = "$Id: hash_util.c,v 1.9 2006/07/17 09:22:31 xtof Ex
 /* modify hash_f(), hash_comp() and the typedef of hash_entry in hash_utils.h
    to suit your application */
 
-PUBLIC void * lookup_hash (void *x);
-PUBLIC int write_hash (void *x);
-PUBLIC void delete_hash (void *x);
-PUBLIC void kill_hash();
-PUBLIC void initialize_hash();
+PUBLIC hash_table *new_hash (void);
+PUBLIC void free_hash (hash_table *T);
+PUBLIC void * lookup_hash (hash_table *T, void *x);
+PUBLIC void lookup_hash_batch (hash_table *T, void **x, void **found, int n);
+PUBLIC int write_hash (hash_table *T, void *x);
+PUBLIC void delete_hash (hash_table *T, void *x);
+PUBLIC void kill_hash (hash_table *T);
+PUBLIC void clear_hash (hash_table *T, hash_entry *x, unsigned long n);
 PUBLIC int hash_comp(void *x, void *y);
 
 inline PRIVATE unsigned hash_f (void *x);
@@ -37,9 +40,17 @@ inline PRIVATE unsigned hash_f (void *x);
 /* #define HASHSIZE 16777216 -1 */ /* 2^24 -1   must be power of 2 -1 */ 
 /* #define HASHSIZE 4194304 -1  */ /* 2^22 -1   must be power of 2 -1 */
 
-PRIVATE void *hashtab[HASHSIZE+1];
 
-PUBLIC unsigned long collisions=0;
+/* keys hashed ahead by lookup_hash_batch() */
+#ifndef HASH_BATCH
+#define HASH_BATCH 32
+#endif
+
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p)
+#endif
 
 /* ----------------------------------------------------------------- */
 
@@ -76,9 +87,38 @@ PUBLIC int hash_comp(void *x, void *y) {
   return strcmp(((hash_entry *)x)->structure, ((hash_entry *)y)->structure);
 }
 
+/* search x starting at slot hashval */
+inline PRIVATE void *probe_hash(void **hashtab, void *x, unsigned int hashval)
+{
+  while (hashtab[hashval]){
+    if (hash_comp(x,hashtab[hashval])==0) return hashtab[hashval];
+    hashval = ((hashval+1) & (HASHSIZE));
+  }
+  return NULL;
+}
+
+/* ----------------------------------------------------------------- */
+
+PUBLIC hash_table *new_hash (void)
+{
+  hash_table *T;
+
+  T = (hash_table *) space(sizeof(hash_table));
+  T->tab = (void **) space((HASHSIZE+1)*sizeof(void *));
+  return T;
+}
+
+/* ----------------------------------------------------------------- */
+
+PUBLIC void free_hash (hash_table *T)  /* doesn't free the entries */
+{
+  free(T->tab);
+  free(T);
+}
+
 /* ----------------------------------------------------------------- */
  
-PUBLIC void * lookup_hash (void *x)  /* returns NULL unless x is in the hash */ 
+PUBLIC void * lookup_hash (hash_table *T, void *x)  /* returns NULL unless x is in the hash */ 
 { 
   unsigned int hashval;
 
@@ -90,19 +130,40 @@ PUBLIC void * lookup_hash (void *x)  /* returns NULL unless x is in the hash */
 	  ((hash_entry *)x)->structure,
 	  hashval);
 #endif
-  if (hashtab[hashval]==NULL) return NULL; 
-  while (hashtab[hashval]){
-    if (hash_comp(x,hashtab[hashval])==0) return hashtab[hashval];
-    hashval = ((hashval+1) & (HASHSIZE));
+  return probe_hash(T->tab, x, hashval);
+}
+
+/* ----------------------------------------------------------------- */
+
+/* look up n keys, found[i] is the entry matching x[i] or NULL. All
+   hash values of a chunk are computed first and the slots and entries
+   they lead to are prefetched, so the cache misses of the different
+   keys overlap instead of being waited for one by one. */
+PUBLIC void lookup_hash_batch (hash_table *T, void **x, void **found, int n)
+{
+  unsigned int hashval[HASH_BATCH];
+  int i, k, m;
+  void **hashtab = T->tab;
+
+  for (k=0; k<n; k+=m) {
+    m = (n-k<HASH_BATCH) ? n-k : HASH_BATCH;
+    for (i=0; i<m; i++) {
+      hashval[i]=hash_f(x[k+i]);
+      PREFETCH(&hashtab[hashval[i]]);
+    }
+    for (i=0; i<m; i++)
+      if (hashtab[hashval[i]]) PREFETCH(hashtab[hashval[i]]);
+    for (i=0; i<m; i++)
+      found[k+i] = probe_hash(hashtab, x[k+i], hashval[i]);
   }
-  return NULL;
 }
 
 /* ----------------------------------------------------------------- */
     
-PUBLIC int write_hash (void *x)   /* returns 1 if x already was in the hash */ 
+PUBLIC int write_hash (hash_table *T, void *x)   /* returns 1 if x already was in the hash */ 
 {
   unsigned int hashval;
+  void **hashtab = T->tab;
   
   hashval=hash_f(x);
 #ifdef _DEBUG_HASH_
@@ -114,23 +175,17 @@ PUBLIC int write_hash (void *x)   /* returns 1 if x already was in the hash */
   while (hashtab[hashval]){
     if (hash_comp(x,hashtab[hashval])==0) return 1;
     hashval = ((hashval+1) & (HASHSIZE));
-    collisions++;
+    T->collisions++;
   }
   hashtab[hashval]=x;
   return 0;
 }
 /* ----------------------------------------------------------------- */
-  
-PUBLIC void initialize_hash ()
-{
 
-}
-
-/* ----------------------------------------------------------------- */
-
-PUBLIC void kill_hash ()
+PUBLIC void kill_hash (hash_table *T)
 {
   unsigned int i;
+  void **hashtab = T->tab;
   
   for (i=0;i<HASHSIZE+1;i++) {
     if (hashtab[i]) {
@@ -143,18 +198,51 @@ PUBLIC void kill_hash ()
 
 /* ----------------------------------------------------------------- */
 
-PUBLIC void delete_hash (void *x)  /* doesn't work in case of collsions */
-{                                  /* doesn't free anything ! */
+/* empty T for reuse, it holds exactly the n entries of array x. Small
+   landscapes clear just their own slots instead of all 2^HASHBITS */
+PUBLIC void clear_hash (hash_table *T, hash_entry *x, unsigned long n)
+{
+  unsigned long i;
   unsigned int hashval;
+  void **hashtab = T->tab;
+
+  T->collisions = 0;
+  if (n > (HASHSIZE+1)/16) {
+    memset(hashtab, 0, (HASHSIZE+1)*sizeof(void *));
+    return;
+  }
+  for (i=0; i<n; i++) {
+    /* don't stop at empty slots, the probe chain has holes by now */
+    for (hashval=hash_f(x+i); hashtab[hashval]!=x+i;
+	 hashval = ((hashval+1) & (HASHSIZE)));
+    hashtab[hashval]=NULL;
+  }
+}
+
+/* ----------------------------------------------------------------- */
+
+PUBLIC void delete_hash (hash_table *T, void *x)  /* doesn't free anything ! */
+{
+  unsigned int hashval, j, h;
+  void **hashtab = T->tab;
   
   hashval=hash_f(x);
   while (hashtab[hashval]){
-    if (hash_comp(x,hashtab[hashval])==0) {
-      hashtab[hashval]=NULL;
-      return;
-    }
+    if (hash_comp(x,hashtab[hashval])==0) break;
     hashval = ((hashval+1) & (HASHSIZE));
   }
+  if (hashtab[hashval]==NULL) return;
+  /* close the gap, moving back entries that probed past it */
+  for (j=hashval;;) {
+    hashtab[hashval]=NULL;
+    do {
+      j = ((j+1) & (HASHSIZE));
+      if (hashtab[j]==NULL) return;
+      h = hash_f(hashtab[j]);
+    } while ((hashval<=j) ? (hashval<h && h<=j) : (hashval<h || h<=j));
+    hashtab[hashval]=hashtab[j];
+    hashval=j;
+  }
 }
 /* ----------------------------------------------------------------- */
 
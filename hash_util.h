@@ -4,11 +4,19 @@
 #ifndef _hash_util_h
 #define _hash_util_h
 
-extern void * lookup_hash (void *x);
-extern int write_hash (void *x);
-extern void delete_hash (void *x);
-extern void kill_hash();
-extern void initialize_hash();
+/* open addressing hash table with 2^HASHBITS slots */
+typedef struct hash_table {
+  void **tab;                /* slots, NULL if empty */
+  unsigned long collisions;  /* probes past occupied slots in write_hash() */
+} hash_table;
+
+extern hash_table *new_hash (void);
+extern void free_hash (hash_table *T);
+extern void * lookup_hash (hash_table *T, void *x);
+extern void lookup_hash_batch (hash_table *T, void **x, void **found, int n);
+extern int write_hash (hash_table *T, void *x);
+extern void delete_hash (hash_table *T, void *x);
+extern void kill_hash (hash_table *T);
 
 typedef struct _hash_entry {
   char *structure;    /* my structure */ 
@@ -21,6 +29,8 @@ typedef struct _hash_entry {
   int *POV;           /* for Posets only */
 } hash_entry;
 
+extern void clear_hash (hash_table *T, hash_entry *x, unsigned long n);
+
 #endif
 
 /* End of file */
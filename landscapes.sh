@@ -0,0 +1,89 @@
+# landscapes.sh: test landscapes for chk and bench, which set $tmp
+# before sourcing this
+
+# spin glass landscape $1 of $2 spins, energies from a Park-Miller
+# generator rounded to $3 decimals, or integers -3..3 if $3 is 0
+spins () {
+  awk -v n=$2 -v d=$3 'BEGIN {
+    x = 4711; s = ""
+    for (i=0; i<n; i++) s = s "@"
+    print s, 0, "::", "Q2"
+    for (k=0; k<2^n; k++) {
+      s = ""
+      for (i=0; i<n; i++) s = s ((int(k/2^i)%2) ? "-" : "+")
+      x = (x*16807) % 2147483647
+      if (d==0) printf "%s %d\n", s, x%7-3
+      else printf "%s %." d "f\n", s, 20*x/2147483647-10
+    }
+  }' > $tmp/$1.in.u
+  (head -1 $tmp/$1.in.u; tail -n +2 $tmp/$1.in.u | sort -s -g -k2,2) \
+    > $tmp/$1.in
+}
+
+# header for graph $2, then the configurations on stdin with energies
+# from the generator of spins(), sorted, in landscape $1
+energies () {
+  awk 'BEGIN { x = 4711 } {
+    x = (x*16807) % 2147483647
+    printf "%s %.6f\n", $1, 20*x/2147483647-10
+  }' |
+    sort -s -g -k2,2 > $tmp/$1.in.u
+  (head -1 $tmp/$1.in.u |
+    awk -v g=$2 '{gsub(/./, "@", $1); print $1, 0, "::", g}'
+    cat $tmp/$1.in.u) > $tmp/$1.in
+}
+
+# all permutations of 1..$1, in lexicographic order
+perms () {
+  awk -v n=$1 'BEGIN {
+    for (i=1; i<=n; i++) p[i] = i
+    for (;;) {
+      s = p[1]; for (i=2; i<=n; i++) s = s "," p[i]; print s
+      for (i=n-1; i>0 && p[i]>p[i+1]; i--) ;
+      if (i==0) break
+      for (j=n; p[j]<p[i]; j--) ;
+      t = p[i]; p[i] = p[j]; p[j] = t
+      for (j=n; ++i<j; j--) { t = p[i]; p[i] = p[j]; p[j] = t }
+    }
+  }'
+}
+
+# all binary trees with leaves 1..$1, leaf k is put above every
+# subtree of the trees of leaves 1..k-1
+trees () {
+  awk -v n=$1 'BEGIN {
+    m = 1; t[1] = "((1)(2)(3))"
+    for (k=4; k<=n; k++) {
+      nm = 0
+      for (a=1; a<=m; a++) {
+        s = t[a]
+        for (i=6; i<=length(s); i++) {
+          if (substr(s, i, 1)!="(") continue
+          d = 0
+          for (j=i; j<=length(s); j++) {
+            c = substr(s, j, 1)
+            if (c=="(") d++
+            else if (c==")" && --d==0) break
+          }
+          u[++nm] = substr(s, 1, i-1) "(" substr(s, i, j-i+1) "(" k "))" \
+            substr(s, j+1)
+        }
+      }
+      m = nm; for (a=1; a<=m; a++) t[a] = u[a]
+    }
+    for (a=1; a<=m; a++) print t[a]
+  }'
+}
+
+# all words of length $2 over the alphabet $1 that start with its first
+# letter, the relative moves of lattice protein conformations
+words () {
+  awk -v a=$1 -v n=$2 'BEGIN {
+    m = split(a, c, "")
+    for (k=0; k<m^(n-1); k++) {
+      s = c[1]; x = k
+      for (i=1; i<n; i++) { s = s c[x%m+1]; x = int(x/m) }
+      print s
+    }
+  }'
+}
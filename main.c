@@ -13,6 +13,9 @@
 #include "barriers.h"
 #include "hash_util.h"
 #include "cmdline.h"
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 /* PRIVATE FUNCTIONS */
 static char UNUSED rcsid[] = "$Id: main.c,v 1.22 2008/01/10 14:40:03 ivo Exp $";
@@ -23,14 +26,16 @@ static   struct gengetopt_args_info args_info;
 static int decode_switches (int argc, char **argv);
 
 static char* program_name;
+
+static void read_header(barrier_options *o, char *what);
+static int flood_input(landscape **ls, barrier_options o, FILE *out);
+static int run_batch(const char *manifest, int jobs);
+
 /*============================*/
 int main (int argc, char *argv[]) {
-  int tmp;
-  char *line;
-  loc_min *LM;
-  int *tm;
-  int i;
-  char signal[100]="", what[100]="", stuff[100]="";
+  landscape *ls=NULL;
+  char what[100]="";
+  int status;
 
   /* Parse command line */
   program_name = argv[0];
@@ -44,6 +49,12 @@ int main (int argc, char *argv[]) {
   /* Try to parse head to determine graph-type */
   decode_switches (argc, argv);
 
+  if (args_info.batch_given) {
+    status = run_batch(args_info.batch_arg, args_info.jobs_arg);
+    cmdline_parser_free(&args_info);
+    exit(status);
+  }
+
   if (args_info.inputs_num > 0) {
     opt.INFILE = fopen(args_info.inputs[0], "r");
     if (opt.INFILE==NULL) nrerror("can't open file");
@@ -51,19 +62,37 @@ int main (int argc, char *argv[]) {
     opt.INFILE = stdin;
   }
 
-  line = get_line(opt.INFILE);
+  read_header(&opt, what);
+  status = (flood_input(&ls, opt, stdout)) ? EXIT_FAILURE : 0;
+  if (opt.INFILE != stdin) fclose(opt.INFILE);
+
+  /* memory cleanup */
+  if (ls) barriers_close(ls);  /* frees the local minima as well */
+  free(opt.seq);
+  cmdline_parser_free(&args_info);
+  exit(status);
+}
+
+/* parse the headline of o->INFILE, what (100 chars) receives the graph
+   type given there */
+static void read_header(barrier_options *o, char *what) {
+  int tmp;
+  char *line;
+  char signal[100]="", stuff[100]="";
+
+  line = get_line(o->INFILE);
   if (line == NULL) {
     fprintf(stderr,"Error in input file\n");
     exit(123);
   }
-  opt.seq = (char *) space(strlen(line) + 1);
-  sscanf(line,"%s %d %99s %99s %99s", opt.seq, &tmp, signal, what, stuff);
+  o->seq = (char *) space(strlen(line) + 1);
+  sscanf(line,"%s %d %99s %99s %99s", o->seq, &tmp, signal, what, stuff);
   if(strcmp(stuff, "\0")!=0 && strncmp(what, "Q", 1)==0){ /* lattice proteins*/
-    memset(opt.seq, 0, strlen(line)+1);
-    strcpy(opt.seq, stuff);
+    memset(o->seq, 0, strlen(line)+1);
+    strcpy(o->seq, stuff);
   }
 
-  if ((!opt.poset)&&(strcmp(signal,"::")!=0)) {
+  if ((!o->poset)&&(strcmp(signal,"::")!=0)) {
     int r, dim;
     /* in this case we have a poset file !!!! */
     r=sscanf(signal,"P:%d",&dim);
@@ -72,13 +101,13 @@ int main (int argc, char *argv[]) {
 	      "Warning: obscure headline in input file\n");
       dim = 0;
     }
-    if(dim>0) opt.poset  = dim;
+    if(dim>0) o->poset  = dim;
   }
 
-  if (opt.poset) { /* in this case we have a poset file !!!! */
+  if (o->poset) { /* in this case we have a poset file !!!! */
     fprintf(stderr,
 	    "!!! Input data are a poset with %d objective functions\n",
-	    opt.poset);
+	    o->poset);
     /* we have a SECIS design file */
     if (  ((GRAPH != NULL) && (strstr(GRAPH, "SECIS") != NULL))
 	||(strncmp(what, "SECIS", 5) == 0) )
@@ -97,13 +126,13 @@ int main (int argc, char *argv[]) {
 	}
 
 	free(line);
-	line = get_line(opt.INFILE);
+	line = get_line(o->INFILE);
 	len  = strlen(line);
 	sec_structure    = (char*)calloc(len+1, sizeof(char));
 	protein_sequence = (char*)calloc(len+1, sizeof(char));
 	sscanf(line,"%s %s", sec_structure, protein_sequence);
 
-	if (opt.want_verbose)
+	if (o->want_verbose)
 	  fprintf(stderr,
 		  "\nGraph is SECIS design with the following parameters:\n"
 		  "Structure:   %s\n"
@@ -112,12 +141,12 @@ int main (int argc, char *argv[]) {
 		  "Max. number of mutations : %d\n"
 		  "Min. alignment score (aa): %d\n\n",
 		  sec_structure,
-		  opt.seq,
+		  o->seq,
 		  protein_sequence,
 		  max_m,
 		  min_as);
 
-	initialize_SECIS(opt.seq, sec_structure, protein_sequence,
+	initialize_SECIS(o->seq, sec_structure, protein_sequence,
 			 max_m, min_as);
 
 	free(sec_structure);
@@ -133,60 +162,234 @@ int main (int argc, char *argv[]) {
 
   free(line);
 
-  if (GRAPH==NULL)
-    if(strlen(what)) GRAPH = what;
+  if (GRAPH!=NULL) o->GRAPH = GRAPH;
+  else if (strlen(what)) o->GRAPH = what;
+  else o->GRAPH = "RNA";
+}
 
-  if (GRAPH==NULL) GRAPH="RNA";
-  opt.GRAPH=GRAPH;
+/* flood o.INFILE, whose header has been read, and write the results;
+   *ls is reused if set. Returns -1 if the run failed, *ls is then NULL
+   or only good for barriers_reopen() */
+static int flood_input(landscape **ls, barrier_options o, FILE *out) {
+  loc_min *LM;
+  int *tm;
+  int i;
 
-  LM = barriers(opt);
-  if (opt.INFILE != stdin) fclose(opt.INFILE);
-  tm = make_truemin(LM);
+  *ls = (*ls) ? barriers_reopen(*ls, o) : barriers_open(o);
+  if (*ls==NULL) return -1;
+  if (barriers_read(*ls)<0) return -1;
+  if ((LM = barriers_finish(*ls))==NULL) return -1;
+
+  if (o.between) {
+    if (print_between(*ls, out)) return -1;
+    if (args_info.between_path_given) {
+      FILE *PATH;
+      char *name;
+      path_entry *path;
+      if ((path = between_path(*ls))==NULL) return 0;
+      name = (char *) space(strlen("path.between.txt")+
+			    ((o.prefix) ? strlen(o.prefix) : 0)+1);
+      strcat(strcpy(name, (o.prefix) ? o.prefix : ""), "path.between.txt");
+      PATH = fopen(name, "w");
+      if (PATH == NULL) nrerror("couldn't open path file");
+      print_path(*ls, PATH, path, NULL);
+      fclose(PATH);
+      fprintf(stderr, "wrote file %s\n", name);
+      free(path);
+      free(name);
+    }
+    return 0;
+  }
+  tm = make_truemin(*ls, LM);
+  if (o.minima) {
+    print_minima(*ls, out, LM, tm, o.seq);
+    fflush(out);
+    free(tm);
+    return 0;
+  }
 
-  if(opt.poset) mark_global(LM);
+  if(o.poset) mark_global(*ls, LM);
 
-  print_results(LM,tm,opt.seq);
-  fflush(stdout);
+  print_results(*ls, out, LM, tm, o.seq);
+  fflush(out);
 
-  if (!opt.want_quiet) ps_tree(LM,tm,0);
+  if (!o.want_quiet) ps_tree(*ls, LM, tm, 0);
 
-  if (opt.rates || opt.microrates) {
-    compute_rates(tm,opt.seq);
-    if (!opt.want_quiet) ps_tree(LM,tm,1);
-    print_rates(tm[0], "rates.out");
+  if (o.rates || o.microrates) {
+    if (compute_rates(*ls, tm, o.seq)<0) {
+      free(tm);
+      return -1;
+    }
+    if (!o.want_quiet) ps_tree(*ls, LM, tm, 1);
+    print_rates(*ls, tm[0], "rates.out");
   }
-  if (opt.poset) mark_global(LM);
+  if (o.poset) mark_global(*ls, LM);
 
   for (i = 0; i < args_info.path_given; ++i) {
     int L1, L2;
     sscanf(args_info.path_arg[i], "%d=%d", &L1, &L2);
     if ((L1>0) && (L2>0)) {
       FILE *PATH = NULL;
-      char tmp[30];
+      char tmp[30], *name;
       path_entry *path;
 
-      path = backtrack_path(L1, L2, LM, tm);
+      if ((path = backtrack_path(*ls, L1, L2, LM, tm))==NULL) continue;
       (void) sprintf(tmp, "path.%03d.%03d.txt", L1, L2);
+      name = (char *) space(strlen(tmp)+((o.prefix) ? strlen(o.prefix) : 0)+1);
+      strcat(strcpy(name, (o.prefix) ? o.prefix : ""), tmp);
 
-      PATH = fopen (tmp, "w");
+      PATH = fopen (name, "w");
       if (PATH == NULL) nrerror("couldn't open path file");
-      print_path(PATH, path, tm);
+      print_path(*ls, PATH, path, tm);
       /* fprintf(stderr, "%llu %llu\n", 0, MAXIMUM);   */
       fclose (PATH);
-      fprintf (stderr, "wrote file %s\n", tmp);
+      fprintf (stderr, "wrote file %s\n", name);
       free (path);
+      free (name);
     }
   }
-
-  /* memory cleanup */
-  free(opt.seq);
-  free(LM);
   free(tm);
-#if WITH_DMALLOC
-  kill_hash(); /* freeing the hash takes unacceptably long */
+  return 0;
+}
+
+/* --batch: the input files listed in the manifest are flooded by a pool
+   of jobs threads. The results for FILE go to FILE.bar, other output
+   files get "FILE." prepended. Every thread keeps one landscape and
+   reuses its tables for all the files it floods. */
+typedef struct {
+  char **files;
+  int n, next;
+  int failed;      /* files that could not be flooded */
+#if HAVE_PTHREAD
+  pthread_mutex_t lock;
 #endif
-  cmdline_parser_free(&args_info);
-  exit(0);
+} batch_queue;
+
+/* returns -1 if file could not be flooded */
+static int flood_file(landscape **ls, const char *file) {
+  barrier_options o = opt;
+  char what[100]="", *name;
+  FILE *out;
+  int status=0;
+
+  o.INFILE = fopen(file, "r");
+  if (o.INFILE==NULL) {
+    fprintf(stderr, "can't open %s, skipped\n", file);
+    return -1;
+  }
+  o.prefix = (char *) space(strlen(file)+2);
+  strcat(strcpy(o.prefix, file), ".");
+  name = (char *) space(strlen(file)+5);
+  strcat(strcpy(name, o.prefix), "bar");
+  out = fopen(name, "w");
+  if (out==NULL) nrerror("can't open output file");
+  read_header(&o, what);
+  if ((status = flood_input(ls, o, out)))
+    fprintf(stderr, "%s failed, skipped\n", file);
+  else if (!o.want_quiet) fprintf(stderr, "wrote %s\n", name);
+  fclose(out);
+  fclose(o.INFILE);
+  free(name);
+  free(o.prefix);
+  free(o.seq);
+  return status;
+}
+
+static void *batch_worker(void *arg) {
+  batch_queue *q = (batch_queue *) arg;
+  landscape *ls = NULL;
+  int k, bad=0;
+  for (;;) {
+#if HAVE_PTHREAD
+    pthread_mutex_lock(&q->lock);
+#endif
+    q->failed += bad;
+    k = q->next++;
+#if HAVE_PTHREAD
+    pthread_mutex_unlock(&q->lock);
+#endif
+    if (k>=q->n) break;
+    bad = (flood_file(&ls, q->files[k])) ? 1 : 0;
+  }
+  if (ls) barriers_close(ls);
+  return NULL;
+}
+
+/* 1 if the header of file names a graph that can't be flooded in
+   parallel, see run_batch() */
+static int serial_graph(const char *file) {
+  FILE *fp;
+  char *line, what[100]="";
+  int tmp;
+
+  if ((fp = fopen(file, "r"))==NULL) return 0;
+  if ((line = get_line(fp))) {
+    sscanf(line, "%*s %d %*s %99s", &tmp, what);
+    free(line);
+  }
+  fclose(fp);
+  return what[0]=='S';
+}
+
+/* returns EXIT_FAILURE if any of the files could not be flooded */
+static int run_batch(const char *manifest, int jobs) {
+  FILE *fp;
+  char *line, *s;
+  const char *serial;
+  batch_queue q;
+  int i, max=64;
+
+  fp = fopen(manifest, "r");
+  if (fp==NULL) nrerror("can't open batch manifest");
+  q.n = q.next = q.failed = 0;
+  q.files = (char **) space(max*sizeof(char *));
+  while ((line = get_line(fp))) {
+    for (s=line; isspace((unsigned char) *s); s++);
+    for (i=strlen(s); i>0 && isspace((unsigned char) s[i-1]); i--) s[i-1]='\0';
+    if (*s && *s!='#') {
+      if (q.n==max) {
+	max *= 2;
+	q.files = (char **) xrealloc(q.files, max*sizeof(char *));
+      }
+      q.files[q.n++] = strdup(s);
+    }
+    free(line);
+  }
+  fclose(fp);
+
+  if (jobs>q.n) jobs = q.n;
+  /* plugins and SECIS keep their state in globals, and read_header()
+     sets up SECIS for a file whose header names it whatever -G says */
+  serial = (opt.plugin) ? opt.plugin : (GRAPH && GRAPH[0]=='S') ? GRAPH : NULL;
+  for (i=0; jobs>1 && !serial && i<q.n; i++)
+    if (serial_graph(q.files[i])) serial = q.files[i];
+  if (jobs>1 && serial) {
+    fprintf(stderr, "can't flood %s in parallel, using one job\n", serial);
+    jobs = 1;
+  }
+#if HAVE_PTHREAD
+  if (jobs>1) {
+    pthread_t *pool;
+    pthread_mutex_init(&q.lock, NULL);
+    pool = (pthread_t *) space(jobs*sizeof(pthread_t));
+    for (i=1; i<jobs; i++)
+      if (pthread_create(pool+i, NULL, batch_worker, &q))
+	nrerror("can't create thread");
+    batch_worker(&q);
+    for (i=1; i<jobs; i++) pthread_join(pool[i], NULL);
+    free(pool);
+    pthread_mutex_destroy(&q.lock);
+  }
+  else
+#else
+  if (jobs>1)
+    fprintf(stderr, "barriers was built without thread support,"
+	    " ignoring --jobs\n");
+#endif
+  batch_worker(&q);
+  for (i=0; i<q.n; i++) free(q.files[i]);
+  free(q.files);
+  return (q.failed) ? EXIT_FAILURE : 0;
 }
 
 static int decode_switches (int argc, char **argv)
@@ -211,6 +414,36 @@ static int decode_switches (int argc, char **argv)
   GRAPH = args_info.graph_arg;
   if (args_info.moves_given) opt.MOVESET = args_info.moves_arg;
   if (args_info.temp_given) opt.kT = args_info.temp_arg;
+  if (args_info.edges_given) opt.edges = args_info.edges_arg;
+  if (args_info.plugin_given) opt.plugin = args_info.plugin_arg;
+  opt.generic_kernel = args_info.generic_kernel_given;
+  opt.threads = args_info.threads_arg;
+  opt.window = args_info.window_arg;
+  if (args_info.stream_given) opt.stream = args_info.stream_arg;
+  opt.progress = args_info.progress_arg;
+  if (args_info.snapshot_given) opt.snapshot = args_info.snapshot_arg;
+  opt.snapshot_every = args_info.snapshot_every_arg;
+  if (args_info.resume_given) opt.resume = args_info.resume_arg;
+  if (args_info.between_given) opt.between = args_info.between_arg;
+  opt.prune = args_info.prune_given;
+  if (opt.prune && args_info.path_given) {
+    fprintf(stderr, "--prune ignored, paths need all local minima\n");
+    opt.prune = 0;
+  }
+  opt.minima = args_info.minima_given;
+  if (args_info.edge_spill_given) opt.edge_spill = args_info.edge_spill_arg;
+  opt.cache_edges = args_info.cache_edges_given || args_info.edge_spill_given;
+  opt.ordered_rates = args_info.ordered_rates_given;
+  opt.sparse_rates = args_info.sparse_rates_given;
+  if (opt.minima && (opt.bsize || opt.ssize || opt.rates || opt.microrates ||
+		     opt.between || opt.prune || args_info.path_given)) {
+    fprintf(stderr, "--minima finds no saddles, ignoring --bsize, --ssize, "
+	    "--rates, -P, --between and --prune\n");
+    opt.bsize = opt.ssize = opt.rates = opt.microrates = opt.prune = 0;
+    opt.between = NULL;
+  }
+  if (args_info.batch_given && args_info.inputs_num>0)
+    nrerror("give either an input file or --batch");
   for (i = 0; i < args_info.path_given; ++i) {
     int L1,L2;
     if (sscanf(args_info.path_arg[i], "%d=%d", &L1, &L2) != 2)
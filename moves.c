@@ -1,73 +1,86 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include "utils.h"
 #include "stapel.h"
+#include "moves.h"
+#include "packed_moves.h"
 
-#define NUM 5555
 
 static char UNUSED rcsid[] = "$Id: moves.c,v 1.9 2004/05/03 14:58:50 mtw Exp $";
 
-static char *ALPHABET;
-static int  ALPHASIZE;
+THREADLOCAL move_conf *MC=NULL;   /* move set settings of the current landscape */
+
 
-static char *ADJLIST;
 void  put_ADJLIST(char *A);
 /* static char *get_ADJLIST(void); */
 
-static char **move;
+/* Crankshaft moves for lattice proteins on the square (SQ, alphabet FLR)
+   and simple cubic (SC, alphabet FLRUD) lattice.  The rules below are
+   compiled into lookup tables indexed by the 3-bit codes of a window of
+   relative moves, both directions of every rule. */
+static const char *sq_rules[] = {
+  "LRL","FLF", "RLR","FRF", "LRF","FLR", "RLF","FRL", "LRRL","RLLR", NULL};
+static const char *sc_rules[] = {
+  "LRF","DDR", "LRL","DDD", "LRR","DDU", "LRD","DDF", "RLF","DUL", "RLL","DUU",
+  "RLR","DUD", "RLU","DUF", "UDF","RRD", "UDR","RRF", "UDU","RRR", "UDD","RRL",
+  "UUF","LLU", "UUL","LLF", "UUU","LLL", "UUD","LLR", "FLF","LUL", "FLL","LUU",
+  "FLR","LUD", "FLU","LUF", "ULF","FUL", "ULL","FUU", "ULR","FUD", "ULU","FUF",
+  "FDF","DRD", "FDR","DRF", "FDU","DRR", "FDD","DRL", "FRF","RDR", "FRL","RDD",
+  "FRR","RDU", "FRD","RDF", "RDLU","LURD", "DRUL","ULDR", NULL};
+/* moves of the last two letters */
+static const char *sq_end_rules[] = {"LR","FL", "FR","RL", NULL};
+static const char *sc_end_rules[] = {
+  "FL","LU", "FR","RD", "FU","UL", "FD","DR",
+  "LL","UU", "LR","DD", "RL","DU", "RR","UD", NULL};
+
+static const char cs_letter[] = "?FLRUD";
+static THREADLOCAL unsigned char *cs_code=NULL; /* packed conformation */
+static THREADLOCAL char *cs_work=NULL;
+static THREADLOCAL int cs_max=0;
+
+static int cs_encode(char c) {
+  char *pos;
+  if (c=='\0' || c=='?' || (pos=strchr(cs_letter, c))==NULL) return 0;
+  return (int) (pos-cs_letter);
+}
 
-void initialize_crankshaft(void){
+static int cs_index(const char *w) {
+  int idx=0;
+  for (; *w; w++) idx = (idx<<CS_BITS) | cs_encode(*w);
+  return idx;
+}
+
+static void cs_compile(const char **rules, int end) {
   int i;
-  
-  move = (char **)calloc(NUM, sizeof(char *));
-  for (i=0; i<NUM; i++)
-    move[i] = (char *)calloc(5, sizeof(char));
+  for (i=0; rules[i]; i+=2) {
+    int a, b, l = strlen(rules[i]);
+    a = cs_index(rules[i]); b = cs_index(rules[i+1]);
+    if (end) { MC->cs_end[a] = b; MC->cs_end[b] = a; continue; }
+    /* a replacement is used only if it contains letters of the alphabet */
+    if (strpbrk(rules[i+1], MC->alphabet)) {
+      if (l==3) MC->cs_move3[a] = b; else MC->cs_move4[a] = b;
+    }
+    if (strpbrk(rules[i], MC->alphabet)) {
+      if (l==3) MC->cs_move3[b] = a; else MC->cs_move4[b] = a;
+    }
+  }
+}
 
-  switch (ALPHASIZE){   /* 123 */
+void initialize_crankshaft(void){
+  memset(MC->cs_move3, 0, sizeof(MC->cs_move3));
+  memset(MC->cs_move4, 0, sizeof(MC->cs_move4));
+  memset(MC->cs_end, 0, sizeof(MC->cs_end));
+  switch (MC->alphasize){
   case 3:               /* FLR : SQ lattice */
-    strcpy( move[232], "FLF\0");  strcpy( move[121], "LRL\0");  /* LRL <-> FLF */
-    strcpy( move[323], "FRF\0");  strcpy( move[131], "RLR\0");  /* RLR <-> FRF */
-    strcpy( move[231], "FLR\0");  strcpy( move[123], "LRF\0");  /* LRF <-> FLR */
-    strcpy( move[321], "FRL\0");  strcpy( move[132], "RLF\0");  /* RLF <-> FRL */
-    strcpy(move[2332], "RLLR\0"); strcpy(move[3223], "LRRL\0"); /* LRRL <-> RLLR */
+    cs_compile(sq_rules, 0);
+    cs_compile(sq_end_rules, 1);
     break;
-  case 5:               /* 12345 */
-                        /* FLRUD: SC lattice */
-    strcpy( move[231], "DDR\0");  strcpy( move[553], "LRF\0");  /* LRF <-> DDR */
-    strcpy( move[232], "DDD\0");  strcpy( move[555], "LRL\0");  /* LRL <-> DDD */
-    strcpy( move[233], "DDU\0");  strcpy( move[554], "LRR\0");  /* LRR <-> DDU */
-    strcpy( move[235], "DDF\0");  strcpy( move[551], "LRD\0");  /* LRD <-> DDF */
-    strcpy( move[321], "DUL\0");  strcpy( move[542], "RLF\0");  /* RLF <-> DUL */
-    strcpy( move[322], "DUU\0");  strcpy( move[544], "RLL\0");  /* RLL <-> DUU */
-    strcpy( move[323], "DUD\0");  strcpy( move[545], "RLR\0");  /* RLR <-> DUD */
-    strcpy( move[324], "DUF\0");  strcpy( move[541], "RLU\0");  /* RLU <-> DUF */
-    strcpy( move[451], "RRD\0");  strcpy( move[335], "UDF\0");  /* UDF <-> RRD */
-    strcpy( move[453], "RRF\0");  strcpy( move[331], "UDR\0");  /* UDR <-> RRF */
-    strcpy( move[454], "RRR\0");  strcpy( move[333], "UDU\0");  /* UDU <-> RRR */
-    strcpy( move[455], "RRL\0");  strcpy( move[332], "UDD\0");  /* UDD <-> RRL */
-    strcpy( move[441], "LLU\0");  strcpy( move[224], "UUF\0");  /* UUF <-> LLU */
-    strcpy( move[442], "LLF\0");  strcpy( move[221], "UUL\0");  /* UUL <-> LLF */
-    strcpy( move[444], "LLL\0");  strcpy( move[222], "UUU\0");  /* UUU <-> LLL */
-    strcpy( move[445], "LLR\0");  strcpy( move[223], "UUD\0");  /* UUD <-> LLR */
-    strcpy( move[121], "LUL\0");  strcpy( move[242], "FLF\0");  /* FLF <-> LUL */
-    strcpy( move[122], "LUU\0");  strcpy( move[244], "FLL\0");  /* FLL <-> LUU */
-    strcpy( move[123], "LUD\0");  strcpy( move[245], "FLR\0");  /* FLR <-> LUD */
-    strcpy( move[124], "LUF\0");  strcpy( move[241], "FLU\0");  /* FLU <-> LUF */
-    strcpy( move[421], "FUL\0");  strcpy( move[142], "ULF\0");  /* ULF <-> FUL */
-    strcpy( move[422], "FUU\0");  strcpy( move[144], "ULL\0");  /* ULL <-> FUU */
-    strcpy( move[423], "FUD\0");  strcpy( move[145], "ULR\0");  /* ULR <-> FUD */
-    strcpy( move[424], "FUF\0");  strcpy( move[141], "ULU\0");  /* ULU <-> FUF */
-    strcpy( move[151], "DRD\0");  strcpy( move[535], "FDF\0");  /* FDF <-> DRD */
-    strcpy( move[153], "DRF\0");  strcpy( move[531], "FDR\0");  /* FDR <-> DRF */
-    strcpy( move[154], "DRR\0");  strcpy( move[533], "FDU\0");  /* FDU <-> DRR */
-    strcpy( move[155], "DRL\0");  strcpy( move[532], "FDD\0");  /* FDD <-> DRL */
-    strcpy( move[131], "RDR\0");  strcpy( move[353], "FRF\0");  /* FRF <-> RDR */
-    strcpy( move[132], "RDD\0");  strcpy( move[355], "FRL\0");  /* FRL <-> RDD */
-    strcpy( move[133], "RDU\0");  strcpy( move[354], "FRR\0");  /* FRR <-> RDU */
-    strcpy( move[135], "RDF\0");  strcpy( move[351], "FRD\0");  /* FRD <-> RDF */
-    strcpy(move[3524], "LURD\0"); strcpy(move[2435], "RDLU\0"); /* RDLU <-> LURD */
-    strcpy(move[5342], "ULDR\0"); strcpy(move[4253], "DRUL\0"); /* DRUL <-> ULDR */
+  case 5:               /* FLRUD: SC lattice */
+    cs_compile(sc_rules, 0);
+    cs_compile(sc_end_rules, 1);
     break;
   default:
     break;
@@ -76,154 +89,70 @@ void initialize_crankshaft(void){
 }
 
 void Q_mem_cleanup(void){
-  int i;
-  for(i=0;i<NUM;i++)
-    free(move[i]);
-  free(move);
+  free(cs_code); cs_code=NULL;
+  free(cs_work); cs_work=NULL;
+  cs_max=0;
 }
 
-void String_move_it_crankshaft(char *string){
-  int i,j, length, rep_len, start=1, found_em=0;
-  char cc, *s, *tr_str, numstr[5];
-
-  s = strdup(string);
-   
-  length = strlen(string); 
-  rep_len = 4; /* permute max. 4 letters for crankshaft moves */
-  tr_str = (char *)calloc(rep_len+1, sizeof(char));
+/* write the letters of a packed window of l moves to s */
+static void cs_apply(char *s, int w, int l) {
+  for (l--; l>=0; l--, w >>= CS_BITS)
+    s[l] = cs_letter[w & ((1<<CS_BITS)-1)];
+}
 
-  while(start <= (length - rep_len)+1){
-    int zahl;
-    for(i=0; i<rep_len;i++){
-      
-      switch(s[start+i]){
-      case 'F':
-	strcat(tr_str+i, "1");
-	break;
-      case 'L':
-	strcat(tr_str+i, "2");
-	break;
-      case 'R':
-	strcat(tr_str+i, "3");
-	break;
-      case 'U':
-	strcat(tr_str+i, "4");
-	break;
-      case 'D':
-	strcat(tr_str+i, "5");
-	break;
-      default:
-	break;
-      }
-      if (i >= 2){ /* > 3 letters translated */
-	zahl = atoi(tr_str);
-	if(strpbrk(move[zahl],ALPHABET )){
-	  for(j=0;j<=i;j++)
-	    s[start+j] = move[zahl][j];
-	  /*  fprintf(stdout, "SS %s : pushed %s onto stack\n", string, s); */
-	  push(s);
-	  free(s);
-	  s = strdup(string);
-	  memset(tr_str, 0, rep_len+1);
-	  i++; /* found a 3-letter replacement, no need */
-	       /* to find a 4-letter replacement too */
-	}
-      }
+void String_move_it_crankshaft(char *string){
+  int i, j, length, w3, w4;
+  char cc;
+
+  length = strlen(string);
+  if (length+1>cs_max) {
+    cs_max = length+1;
+    cs_code = (unsigned char *) xrealloc(cs_code, cs_max);
+    cs_work = (char *) xrealloc(cs_work, cs_max);
+  }
+  for (i=0; i<length; i++) cs_code[i] = cs_encode(string[i]);
+  memcpy(cs_work, string, length+1);
+
+  /* first: crankshaft moves on windows of 3 or 4 letters, */
+  /* the first relative move is never changed */
+  for (i=1; i+3<=length; i++) {
+    w3 = (cs_code[i]<<(2*CS_BITS)) | (cs_code[i+1]<<CS_BITS) | cs_code[i+2];
+    if (MC->cs_move3[w3]) {
+      cs_apply(cs_work+i, MC->cs_move3[w3], 3);
+      push(cs_work);
+      memcpy(cs_work+i, string+i, 3);
+      continue; /* found a 3-letter replacement, no need */
+		/* to find a 4-letter replacement too */
+    }
+    if (i+4>length) continue;
+    w4 = (w3<<CS_BITS) | cs_code[i+3];
+    if (MC->cs_move4[w4]) {
+      cs_apply(cs_work+i, MC->cs_move4[w4], 4);
+      push(cs_work);
+      memcpy(cs_work+i, string+i, 4);
     }
-    memset(tr_str, 0, rep_len+1);
-    start++;
   }
-  
-  free(s);
-  if(tr_str != NULL) free(tr_str);
 
   /* second: manipulate end of the string */
-  s = strdup(string);
-  switch (ALPHASIZE){ 
-  case 3: /* SQ */
-    if(strcmp(string+(length-2), "LR") == 0 ){
-      strcpy(s+(length-2), "FL\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "FL") == 0 ){
-      strcpy(s+(length-2), "LR\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "FR") == 0 ){
-      strcpy(s+(length-2), "RL\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "RL") == 0 ){
-      strcpy(s+(length-2), "FR\0"); found_em = 1;
-    }
-    break;
-  case 5: /* SC */
-    if(strcmp(string+(length-2), "FL") == 0 ){
-      strcpy(s+(length-2), "LU\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "LU") == 0 ){
-      strcpy(s+(length-2), "FL\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "FR") == 0 ){
-      strcpy(s+(length-2), "RD\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "RD") == 0 ){
-      strcpy(s+(length-2), "FR\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "FU") == 0 ){
-      strcpy(s+(length-2), "UL\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "UL") == 0 ){
-      strcpy(s+(length-2), "FU\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "FD") == 0 ){
-      strcpy(s+(length-2), "DR\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "DR") == 0 ){
-      strcpy(s+(length-2), "FD\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "LL") == 0 ){
-      strcpy(s+(length-2), "UU\0"); found_em = 1;
+  if (length>=2) {
+    w3 = (cs_code[length-2]<<CS_BITS) | cs_code[length-1];
+    if (MC->cs_end[w3]) {
+      cs_apply(cs_work+length-2, MC->cs_end[w3], 2);
+      push(cs_work);
+      memcpy(cs_work+length-2, string+length-2, 2);
     }
-    else if (strcmp(string+(length-2), "UU") == 0 ){
-      strcpy(s+(length-2), "LL\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "LR") == 0 ){
-      strcpy(s+(length-2), "DD\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "DD") == 0 ){
-      strcpy(s+(length-2), "LR\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "RL") == 0 ){
-      strcpy(s+(length-2), "DU\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "DU") == 0 ){
-      strcpy(s+(length-2), "RL\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "RR") == 0 ){
-      strcpy(s+(length-2), "UD\0"); found_em = 1;
-    }
-    else if (strcmp(string+(length-2), "UD") == 0 ){
-      strcpy(s+(length-2), "RR\0"); found_em = 1;
-    }
-    break;
-  default:
-    break;
-  }
-   
-  if (found_em){
-    push(s);
-  /*   fprintf(stdout, "SS %s : pushed %s onto stack (end)\n", string, s); */
   }
-  free(s);
 
- /* third: do end move(s): derived from pivot-routine */
-  s = strdup(string);
-  cc = s[length-1]; /* the last relative move */
-  for (j = 0; j < ALPHASIZE; j++){    /* exchange current char with all possible ones */ 
-    if(cc == ALPHABET[j]) continue; /* skip current char, needs not to be changed */
-    s[length-1] = ALPHABET[j];
-    push(s);
-   /*  fprintf(stdout, "SS %s : pushed %s onto stack (end pivot)\n", string, s); */
+  /* third: do end move(s): derived from pivot-routine */
+  if (length>=1) {
+    cc = string[length-1]; /* the last relative move */
+    for (j = 0; j < MC->alphasize; j++){ /* exchange current char with all possible ones */
+      if(cc == MC->alphabet[j]) continue; /* skip current char, needs not to be changed */
+      cs_work[length-1] = MC->alphabet[j];
+      push(cs_work);
+    }
+    cs_work[length-1] = cc;
   }
-  free(s);
   return;
 }
 
@@ -236,10 +165,10 @@ void String_move_it(char *string) {
 
   for (i=0;i<length;i++) {
     ID=0;
-    for (j=0;j<ALPHASIZE;j++) {
-      if(ALPHABET[j]!=string[i]) {
+    for (j=0;j<MC->alphasize;j++) {
+      if(MC->alphabet[j]!=string[i]) {
 	strcpy(s,string);
-	s[i]=ALPHABET[j];
+	s[i]=MC->alphabet[j];
 	push(s);
       }
       else ID++;
@@ -252,245 +181,540 @@ void String_move_it(char *string) {
 }
 
 void String_set_alpha(char *alpha) {
-  ALPHABET = alpha;
-  ALPHASIZE = strlen(alpha);
-}
-
-void SPIN_move_it(char *string) {
-  /* generate 1-point error mutants */
-   int i,length;
-   char *s;
-   length = strlen(string);
-   s = (char *) space((length+1)*sizeof(char));
-
-   for (i=0;i<length;i++) { 
-     strcpy(s,string);
-     if( s[i]=='+') s[i]='-'; else s[i]='+';
-     push(s);
-   }
-   free(s);
-}
-
-void SPIN_complement_move_it(char *string) {
-  /* complement string after position k for all k */
-   int i,length;
-   char *s;
-   length = strlen(string);
-   s=strdup(string);
-   for (i=length-1;i>=0;i--) { 
-     if( s[i]=='+') s[i]='-'; else s[i]='+';
-     push(s);
-   }
-   free(s);
-}
-
-/* Move-sets on Permutations */
-static int *String2Perm(char *perm) {
-  int i,k,n;
-  int *P;
-  char *s,*line;
-  line = strdup(perm);
-  for (k=i=0;i<strlen(line);i++) if (line[i]==',') k++;
-  n=k+1;
-  P = (int *) space(sizeof(int)*(n+1));
-  P[0]=n;
-  s = strtok(line, ",\n");
-  for (i=1;i<=n;i++) {
-    (void)sscanf(s,"%d",&k);
-    P[i]=k;
-    s=strtok(NULL,",\n");
-  }
-  free(line);
-  return P;
-}
-
-static char *Perm2String(int *P) {
-  char tmp[1000];
-  char digit[10];
-  char *string;
-  int i,n;
-  n = P[0];
-  tmp[0]='\0';
-  for (i=1;i<n;i++) {
-    sprintf(digit,"%d,",P[i]); strcat(tmp,digit);
-  }
-  sprintf(digit,"%d",P[i]); strcat(tmp,digit);
-  string = strdup(tmp);
-  return string;
-}
-
-void Transpos_move_it(char *perm) {
-  int i,j,jj,n;
-  int *P;
-  char *s;
-  
-  P = String2Perm(perm);
-  n = P[0];
-  
-  for (i=1;i<n;i++)
-    for (j=i+1;j<=n;j++) {
-      jj = P[i];P[i]=P[j];P[j]=jj;  /* transpose i,j */
-      s = Perm2String(P);
-      jj = P[i];P[i]=P[j];P[j]=jj;  /* transpose i,j again to restore P */
-      push(s);
-      free(s);
-    }
-  free(P);
+  MC->alphabet = alpha;
+  MC->alphasize = strlen(alpha);
 }
 
-void CTranspos_move_it(char *perm) {
-  int i,j,jj,n;
-  int *P;
-  char *s;
-  
-  P = String2Perm(perm);
-  n = P[0];
-  
-  for (i=1;i<n;i++) {
-    j=i+1;
-    jj = P[i];P[i]=P[j];P[j]=jj;  /* transpose i,j */
-    s = Perm2String(P);
-    jj = P[i];P[i]=P[j];P[j]=jj;  /* transpose i,j again to restore P */
-    push(s);
-    free(s);
+/* Spin move-sets work on packed keys (see pack_spin()): each key byte
+   holds 7 spins below a guard bit, so neighbors are generated by
+   XOR-ing bit masks into the key and pushed without re-packing */
+static THREADLOCAL unsigned char *spin_work=NULL;
+static THREADLOCAL int *spin_up=NULL, *spin_down=NULL;
+static THREADLOCAL int spin_max=0;
+static THREADLOCAL spin_ws spin_state;
+
+/* the move sets of packed_moves.h hand their neighbors to push() */
+static void push_key(void *ctx, const char *key) {
+  push((char *) key);
+}
+
+spin_ws *spin_start(const char *packed) {
+  int l;
+  l = strlen(packed);
+  if (MC->spin_len+1>spin_max) { /* a key has at most spin_len bytes */
+    spin_max = MC->spin_len+1;
+    spin_work = (unsigned char *) xrealloc(spin_work, spin_max);
+    spin_up   = (int *) xrealloc(spin_up,   spin_max*sizeof(int));
+    spin_down = (int *) xrealloc(spin_down, spin_max*sizeof(int));
   }
-  free(P);
+  memcpy(spin_work, packed, l+1);
+  spin_state.key = spin_work;
+  spin_state.up = spin_up;
+  spin_state.down = spin_down;
+  spin_state.n = MC->spin_len;
+  return &spin_state;
 }
 
-void Reversal_move_it(char *perm) {
-  int i,j,k,n;
-  int *P, *P1;
-  char *s;
-  
-  P  = String2Perm(perm);  
-  n  = P[0];
-  P1 = space(sizeof(int)*(n+1));
-  
-  for (i=1;i<n;i++)
-    for (j=i+1;j<=n;j++) {
-      for (k=1;k<i;k++) P1[k]=P[k];
-      for (k=0;k<j-i;k++) P1[i+k] = P[j-k];
-      for (k=j+1;k<=n;k++) P1[k] = P[k];
-      s = Perm2String(P);
-      push(s);
-      free(s);
+void SPIN_move_it(char *packed) {
+  spin_flip_moves(spin_start(packed), push_key, NULL);
+}
+
+void SPIN_complement_move_it(char *packed) {
+  spin_complement_moves(spin_start(packed), push_key, NULL);
+}
+
+/* Move-sets on Permutations: a permutation of 1..n is kept as an
+   integer array and keyed by its Lehmer code d[k] = #{l>k: P[l]<P[k]},
+   one digit per byte below a guard bit (two bytes if n>128).  Swapping
+   or reversing P[i..j] leaves all digits outside i..j unchanged, and
+   the digits inside are updated from those of P, O(j-i) per move. */
+#define PERM_MAX (1<<14)           /* two 7 bit bytes per digit */
+static THREADLOCAL int perm_max=0;
+static THREADLOCAL int *perm_P=NULL;
+static THREADLOCAL int *perm_d=NULL;      /* Lehmer digits of perm_P */
+static THREADLOCAL int *perm_tail=NULL, *perm_below=NULL;
+static THREADLOCAL char *perm_used=NULL;
+static THREADLOCAL unsigned char *perm_key=NULL;
+
+static void perm_alloc(int n) {
+  if (n+1>perm_max) {
+    perm_max = n+1;
+    perm_P     = (int *) xrealloc(perm_P, perm_max*sizeof(int));
+    perm_d     = (int *) xrealloc(perm_d, perm_max*sizeof(int));
+    perm_tail  = (int *) xrealloc(perm_tail, perm_max*sizeof(int));
+    perm_below = (int *) xrealloc(perm_below, perm_max*sizeof(int));
+    perm_used  = (char *) xrealloc(perm_used, perm_max);
+    perm_key   = (unsigned char *) xrealloc(perm_key, 2*perm_max);
+  }
+}
+
+/* compute all Lehmer digits of P into key */
+static void perm_digits(const int *P, unsigned char *key) {
+  int k,l,d;
+  for (k=0; k<MC->perm_n; k++) {
+    for (d=0, l=k+1; l<MC->perm_n; l++)
+      if (P[l]<P[k]) d++;
+    perm_put(key, k, d, MC->perm_w);
+  }
+}
+
+/* decode a Lehmer code key into perm_P and perm_d */
+static void perm_unrank(const unsigned char *key) {
+  int k,v,d;
+  perm_alloc(MC->perm_n);
+  memset(perm_used, 0, MC->perm_n+1);
+  for (k=0; k<MC->perm_n; k++) {
+    if (MC->perm_w==1) d = key[k] & 127;
+    else d = ((key[2*k] & 127)<<7) | (key[2*k+1] & 127);
+    perm_d[k] = d;
+    for (v=1; d>0 || perm_used[v]; v++)
+      if (!perm_used[v]) d--;
+    perm_used[v] = 1;
+    perm_P[k] = v;
+  }
+}
+
+char *pack_perm(const char *perm) {
+  int k,n;
+  const char *s;
+  char *end;
+  unsigned char *packed;
+  for (n=1, s=perm; *s; s++) if (*s==',') n++;
+  if (MC->perm_n!=n) { /* lookup threads read these concurrently */
+    if (n>PERM_MAX) {
+      fprintf(stderr, "pack_perm: permutations of more than 16384 elements "
+	      "are not supported\n");
+      return NULL;
     }
-  free(P);
-  free(P1);
+    MC->perm_n = n;
+    MC->perm_w = (n>128) ? 2 : 1;
+  }
+  perm_alloc(n);
+  memset(perm_used, 0, n+1);
+  for (k=0, s=perm; k<n; k++, s=end+1) {
+    perm_P[k] = (int) strtol(s, &end, 10);
+    if (end==s || perm_P[k]<1 || perm_P[k]>n || perm_used[perm_P[k]]) {
+      fprintf(stderr, "pack_perm: %s is not a permutation of 1..%d\n",
+	      perm, n);
+      return NULL;
+    }
+    perm_used[perm_P[k]] = 1;
+  }
+  packed = (unsigned char *) space(MC->perm_w*n+1);
+  perm_digits(perm_P, packed);
+  return (char *) packed;
+}
+
+char *unpack_perm(const char *packed) {
+  int k,l;
+  char *perm;
+  perm_unrank((const unsigned char *) packed);
+  for (l=k=0; k<MC->perm_n; k++) {
+    int v;
+    for (v=perm_P[k], l++; v>0; v/=10) l++; /* digits plus separator */
+  }
+  perm = (char *) space(l+1);
+  for (l=k=0; k<MC->perm_n; k++)
+    l += sprintf(perm+l, (k>0) ? ",%d" : "%d", perm_P[k]);
+  return perm;
+}
+
+static THREADLOCAL perm_ws perm_state;
+
+perm_ws *perm_start(const char *packed) {
+  perm_unrank((const unsigned char *) packed);
+  memcpy(perm_key, packed, MC->perm_w*MC->perm_n+1);
+  perm_state.packed = (const unsigned char *) packed;
+  perm_state.key = perm_key;
+  perm_state.P = perm_P;
+  perm_state.d = perm_d;
+  perm_state.tail = perm_tail;
+  perm_state.below = perm_below;
+  perm_state.n = MC->perm_n;
+  perm_state.w = MC->perm_w;
+  return &perm_state;
+}
+
+void Transpos_move_it(char *packed) {
+  perm_transposition_moves(perm_start(packed), push_key, NULL);
+}
+
+void CTranspos_move_it(char *packed) {
+  perm_ctransposition_moves(perm_start(packed), push_key, NULL);
+}
+
+void Reversal_move_it(char *packed) {
+  perm_reversal_moves(perm_start(packed), push_key, NULL);
+}
+
+/* Move-sets for Trees: an unrooted binary tree with n leaves is keyed
+   by its n-3 non-trivial splits.  A split is written as the set of
+   leaves on the side not containing leaf 1, leaves 2..n at 7 per byte
+   below a guard bit, and the splits are sorted.  An NNI move changes
+   exactly one split, so neighbor keys are made by replacing that split
+   in the sorted list of the one working tree. */
+static THREADLOCAL int tree_max=0;
+static THREADLOCAL unsigned char *tree_set=NULL; /* leaf set of each node */
+static THREADLOCAL int *tree_parent=NULL, *tree_child=NULL, *tree_size=NULL;
+static THREADLOCAL int *tree_minleaf=NULL;
+static THREADLOCAL unsigned char *tree_key=NULL;
+
+/* nodes 0..n-2 are leaves 2..n, then one node per split, then the root */
+#define TSET(v) (tree_set+(v)*MC->tree_nb)
+#define TLEAF(l,k) ((k)[((l)-2)/7] & spin_mask[((l)-2)%7])
+
+/* work buffers for trees with tree_n leaves */
+static void tree_buffers(void) {
+  int nodes;
+  nodes = 2*MC->tree_n;
+  if (nodes*(MC->tree_nb+1) > tree_max) {
+    tree_max = nodes*(MC->tree_nb+1);
+    tree_set     = (unsigned char *) xrealloc(tree_set, tree_max);
+    tree_key     = (unsigned char *) xrealloc(tree_key, tree_max);
+    tree_parent  = (int *) xrealloc(tree_parent,  tree_max*sizeof(int));
+    tree_child   = (int *) xrealloc(tree_child, 2*tree_max*sizeof(int));
+    tree_size    = (int *) xrealloc(tree_size,    tree_max*sizeof(int));
+    tree_minleaf = (int *) xrealloc(tree_minleaf, tree_max*sizeof(int));
+  }
+}
+
+static void tree_alloc(int n) {
+  if (MC->tree_n!=n) {
+    MC->tree_n  = n;
+    MC->tree_nb = (n+5)/7;
+  }
+  tree_buffers();
+}
+
+static int split_cmp(const void *a, const void *b) {
+  return memcmp(a, b, MC->tree_nb);
 }
 
-/* Move-sets for Trees */
-#include "trees.h"
+/* is leaf set a a proper subset of b? */
+static int tree_subset(const unsigned char *a, const unsigned char *b) {
+  int i;
+  for (i=0; i<MC->tree_nb; i++)
+    if (a[i] & ~b[i]) return 0;
+  return 1;
+}
 
-void NNI_move_it(char *string) {
-  /* Nearest neighbor Interchange moves */
-   int i,nl,nneigh;
-   char *s;
-   Tree *T; Tree *T_NNI;
+/* set up the working tree from a key */
+static void tree_build(const unsigned char *key) {
+  int i,v,u,l,n,k,root;
+  n = MC->tree_n; k = n-3; root = n-1+k;
+  tree_buffers();
+  memset(tree_set, 128, (root+1)*MC->tree_nb);
+  for (l=2; l<=n; l++) {
+    TSET(l-2)[(l-2)/7] |= spin_mask[(l-2)%7];
+    TSET(root)[(l-2)/7] |= spin_mask[(l-2)%7];
+  }
+  memcpy(TSET(n-1), key, k*MC->tree_nb);
+  for (v=0; v<=root; v++) {
+    tree_size[v] = 0; tree_minleaf[v] = 0;
+    for (l=n; l>=2; l--)
+      if (TLEAF(l,TSET(v))) { tree_size[v]++; tree_minleaf[v] = l; }
+    tree_child[2*v] = tree_child[2*v+1] = -1;
+  }
+  /* parent is the smallest split containing a node */
+  for (v=0; v<root; v++) {
+    tree_parent[v] = root;
+    for (u=n-1; u<root; u++)
+      if (tree_size[u]>tree_size[v] &&
+	  tree_size[u]<tree_size[tree_parent[v]] &&
+	  tree_subset(TSET(v), TSET(u)))
+	tree_parent[v] = u;
+    u = tree_parent[v];
+    i = (tree_child[2*u]<0) ? 2*u : 2*u+1;
+    tree_child[i] = v;
+  }
+  for (u=n-1; u<=root; u++) /* order children by smallest leaf */
+    if (tree_minleaf[tree_child[2*u]] > tree_minleaf[tree_child[2*u+1]]) {
+      i = tree_child[2*u];
+      tree_child[2*u] = tree_child[2*u+1]; tree_child[2*u+1] = i;
+    }
+}
 
-   /* printf("%s\n",string); */
+static int tree_print(int v, char *s) {
+  int l;
+  if (v<MC->tree_n-1) return sprintf(s, "%d", v+2);
+  l  = sprintf(s, "(");
+  l += tree_print(tree_child[2*v], s+l);
+  l += sprintf(s+l, ")(");
+  l += tree_print(tree_child[2*v+1], s+l);
+  l += sprintf(s+l, ")");
+  return l;
+}
 
-   nl = number_of_leaves(string);
-   nneigh = 2*(nl-3);
-   T  = string2Tree(string);
-   T_NNI = Make_all_NNI(T[0]);
+char *pack_tree(const char *string) {
+  int i,j,n,l,depth,top;
+  const char *s;
+  char *end;
+  unsigned char *sets, *cur, *packed;
+  int nbits;
+  const char *err=NULL;
+
+  for (n=0, s=string; *s; s++)
+    if (isdigit(*s) && !isdigit(s[1])) n++;
+  if (n<3) {
+    fprintf(stderr, "pack_tree: %s: need at least 3 leaves\n", string);
+    return NULL;
+  }
+  tree_alloc(n);
+  nbits = (n+8)/8;
+  /* leaf sets (leaves 1..n) of the open groups, and of all closed groups */
+  sets = (unsigned char *) space((strlen(string)+2)*nbits*2);
+  cur = sets + (strlen(string)+1)*nbits;
+  depth = top = 0;
+  for (s=string; *s && !err; s++) {
+    if (*s=='(') {
+      depth++;
+      memset(cur+depth*nbits, 0, nbits);
+    } else if (*s==')') {
+      if (depth<1) { err = "unbalanced tree"; break; }
+      for (i=0; i<nbits; i++) cur[(depth-1)*nbits+i] |= cur[depth*nbits+i];
+      if (depth>1) memcpy(sets+(top++)*nbits, cur+depth*nbits, nbits);
+      depth--;
+    } else if (isdigit(*s)) {
+      l = (int) strtol(s, &end, 10); s = end-1;
+      if (l<1 || l>n || (cur[depth*nbits+l/8] & (1<<(l%8))))
+	err = "leaves must be numbered 1..n";
+      else cur[depth*nbits+l/8] |= 1<<(l%8);
+    }
+  }
+  if (err==NULL && depth!=0) err = "unbalanced tree";
+  if (err) {
+    fprintf(stderr, "pack_tree: %s: %s\n", string, err);
+    free(sets);
+    return NULL;
+  }
+  /* normalize to the side without leaf 1, keep non-trivial splits */
+  packed = (unsigned char *) space((n-3)*MC->tree_nb+1);
+  for (j=i=0; i<top; i++) {
+    unsigned char *set = sets+i*nbits, *key = tree_key+j*MC->tree_nb;
+    int size=0;
+    memset(key, 128, MC->tree_nb);
+    for (l=2; l<=n; l++)
+      if (((set[l/8]>>(l%8)) & 1) != (set[0]>>1 & 1)) {
+	key[(l-2)/7] |= spin_mask[(l-2)%7];
+	size++;
+      }
+    if (size>1 && size<n-1 && j<2*n) j++;
+  }
+  qsort(tree_key, j, MC->tree_nb, split_cmp);
+  for (l=i=0; i<j; i++)
+    if (i==0 || split_cmp(tree_key+(i-1)*MC->tree_nb, tree_key+i*MC->tree_nb))
+      memcpy(packed+(l++)*MC->tree_nb, tree_key+i*MC->tree_nb, MC->tree_nb);
+  if (l!=n-3) {
+    fprintf(stderr, "pack_tree: %s is not a binary tree\n", string);
+    free(sets); free(packed);
+    return NULL;
+  }
+  free(sets);
+  return (char *) packed;
+}
 
-   for (i=0;i<nneigh;i++) {
-     s = Tree2string(T_NNI[i]);
-     push(s);
-     free(s);
-   }
+char *unpack_tree(const char *packed) {
+  char *s;
+  int l;
+  tree_build((const unsigned char *) packed);
+  s = (char *) space(MC->tree_n*16+8);
+  l  = sprintf(s, "((1)");
+  l += tree_print(2*MC->tree_n-4, s+l);
+  sprintf(s+l, ")");
+  return s;
+}
 
-   FreeTree(T,1);
-   FreeTree(T_NNI,nneigh);
+static THREADLOCAL tree_ws tree_state;
+
+tree_ws *tree_start(const char *packed) {
+  tree_build((const unsigned char *) packed);
+  tree_state.set = tree_set;
+  tree_state.key = tree_key;
+  tree_state.parent = tree_parent;
+  tree_state.child = tree_child;
+  tree_state.n = MC->tree_n;
+  tree_state.nb = MC->tree_nb;
+  return &tree_state;
 }
 
-static int spin_len;
+void NNI_move_it(char *packed) {
+  tree_nni_moves(tree_start(packed), push_key, NULL);
+}
 
-char *unpack_spin(const unsigned char *packed);
 char *pack_spin(const char *spin) {
-  int mask[7] = {64,32,16,8,4,2,1}; 
   int i,j,k,l;
   unsigned char *packed;
-  spin_len = strlen(spin);
-  l = (spin_len+6)/7;
-  packed = (char *) space(l*sizeof(char)+1);
-  for (i=j=0; i<spin_len; j++) {
-    for (k=0; (k<7)&&(i<spin_len); k++, i++) {
-      if (spin[i]=='+') packed[j] |= mask[k];
+  if (MC->spin_len!=(int) strlen(spin)) MC->spin_len = strlen(spin);
+  l = (MC->spin_len+6)/7;
+  packed = (unsigned char *) space(l*sizeof(char)+1);
+  for (i=j=0; i<MC->spin_len; j++) {
+    for (k=0; (k<7)&&(i<MC->spin_len); k++, i++) {
+      if (spin[i]=='+') packed[j] |= spin_mask[k];
       else if (spin[i]!= '-') fprintf(stderr,"Junk in spin %s\n", spin);
     }
-    packed[j]++;
-  }
-#if 0
-  {
-    char *s;
-    s=unpack_spin(packed);
-    if (strcmp(s,spin)!=0)
-      fprintf(stderr, "Error in pack_spin %s %s %s\n", spin, s, packed);
-    free(s);
+    packed[j] |= 128; /* guard bit, never use 0 so we can use strcmp() */
   }
-#endif
-  return packed;
+  return (char *) packed;
 }
 
-char *unpack_spin(const unsigned char *packed) {
+char *unpack_spin(const char *packed) {
   int i,j,k,l;
-  int mask[7] = {64,32,16,8,4,2,1};
   char *spin;
   l = strlen(packed);
   spin = space((7*l+1)*sizeof(char));
   for (i=j=0; j<l; j++) {
-    int p;
-    p = packed[j]-1;
-    for (k=0; k<7; k++) 
-      spin[i++] = (p & mask[k]) ? '+' : '-';
+    for (k=0; k<7; k++)
+      spin[i++] = (packed[j] & spin_mask[k]) ? '+' : '-';
   }
-  spin[spin_len]='\0';
+  spin[MC->spin_len]='\0';
   return spin;
 }
 
-void EXCH_move_it(char *string)
-{
-   int i,j,length;
-   char *s;
-   length = strlen(string);
-   s = (char *) space((length+1)*sizeof(char));
-
-   for (i=0;i<length;i++) {
-     for(j=0;j<length;j++) {
-       if((string[i]=='+')&&(string[j]=='-')) {
-         strcpy(s,string);
-         s[i]='-';
-         s[j]='+';
-         push(s);
-       }
-     }
-   }
-   free(s);
+void EXCH_move_it(char *packed) {
+  spin_exchange_moves(spin_start(packed), push_key, NULL);
 }
 
 
 /********************************************************************/
 
 void put_ADJLIST(char *A) {
-  if(ADJLIST!=NULL) free(ADJLIST);
-  ADJLIST = strdup(A);
+  if(MC->adjlist!=NULL) free(MC->adjlist);
+  MC->adjlist = strdup(A);
 }
 
 void LIST_move_it(char *string) {
-  char *s, *token;
+  char *token, *save;
   /* parse adjacency list and push the token on the stack */
-  /* using strtok */
+  /* using strtok_r */
 
-  token=strtok(ADJLIST,":");
+  if (MC->adjlist==NULL) return;  /* list of the last read vertex only */
+  token=strtok_r(MC->adjlist,":",&save);
   while(token) {
-    s = strdup(token);
-    push(s);
-    token = strtok(NULL,":");
+    push(token);
+    token = strtok_r(NULL,":",&save);
+  }
+  free(MC->adjlist);
+  MC->adjlist = NULL;
+}
+
+/* General graph with integer vertices 0..n-1 and the adjacency in
+   compressed sparse row form.  The binary edge file (native byte
+   order) holds n and the number of arcs m as 64-bit integers, the
+   n+1 64-bit row offsets and the m 32-bit target vertices.  Returns
+   n, or 0 if the file can't be read. */
+
+unsigned long CSR_read(const char *fname) {
+  FILE *fp;
+  unsigned long long head[2], i;
+  const char *err=NULL;
+
+  fp = fopen(fname, "rb");
+  if (fp==NULL) {
+    fprintf(stderr, "can't open edge file %s\n", fname);
+    return 0;
+  }
+  if (fread(head, sizeof(unsigned long long), 2, fp)!=2) {
+    fprintf(stderr, "CSR_read: truncated edge file\n");
+    fclose(fp);
+    return 0;
+  }
+  MC->csr_n = head[0];
+  if (MC->csr_n==0 || MC->csr_n>=(unsigned long long) UINT_MAX) {
+    fprintf(stderr, "CSR_read: bad number of vertices\n");
+    fclose(fp);
+    return 0;
+  }
+  MC->csr_off = (unsigned long long *) space((MC->csr_n+1)*sizeof(unsigned long long));
+  MC->csr_adj = (unsigned int *) space((head[1]+1)*sizeof(unsigned int));
+  if (fread(MC->csr_off, sizeof(unsigned long long), MC->csr_n+1, fp)!=MC->csr_n+1 ||
+      fread(MC->csr_adj, sizeof(unsigned int), head[1], fp)!=head[1])
+    err = "truncated edge file";
+  fclose(fp);
+  if (!err && (MC->csr_off[0]!=0 || MC->csr_off[MC->csr_n]!=head[1]))
+    err = "inconsistent row offsets";
+  for (i=0; i<MC->csr_n && !err; i++)
+    if (MC->csr_off[i+1]<MC->csr_off[i] || MC->csr_off[i+1]-MC->csr_off[i]>INT_MAX)
+      err = "inconsistent row offsets";
+  for (i=0; i<head[1] && !err; i++)
+    if (MC->csr_adj[i]>=MC->csr_n)
+      err = "target vertex out of range";
+  if (err) {
+    fprintf(stderr, "CSR_read: %s\n", err);
+    free(MC->csr_off); MC->csr_off=NULL;
+    free(MC->csr_adj); MC->csr_adj=NULL;
+    return 0;
   }
-  free(ADJLIST);
-  ADJLIST = NULL;
+  return (unsigned long) MC->csr_n;
+}
+
+/* neighbors of vertex v, returns the degree */
+int CSR_neighbors(unsigned long v, const unsigned int **adj) {
+  *adj = MC->csr_adj + MC->csr_off[v];
+  return (int) (MC->csr_off[v+1]-MC->csr_off[v]);
+}
+
+void CSR_free(void) {
+  free(MC->csr_off); MC->csr_off=NULL;
+  free(MC->csr_adj); MC->csr_adj=NULL;
+  MC->csr_n = 0;
+}
+
+/* release the work buffers of the calling thread */
+void free_move_buffers(void) {
+  Q_mem_cleanup();
+  free(spin_work); free(spin_up); free(spin_down);
+  spin_work=NULL; spin_up=spin_down=NULL; spin_max=0;
+  free(perm_P); free(perm_d); free(perm_tail); free(perm_below);
+  free(perm_used); free(perm_key);
+  perm_P=perm_d=perm_tail=perm_below=NULL;
+  perm_used=NULL; perm_key=NULL; perm_max=0;
+  free(tree_set); free(tree_key); free(tree_parent);
+  free(tree_child); free(tree_size); free(tree_minleaf);
+  tree_set=tree_key=NULL; tree_parent=tree_child=tree_size=NULL;
+  tree_minleaf=NULL; tree_max=0;
+}
+
+/********************************************************************/
+
+move_conf *new_move_conf(void) {
+  move_conf *mc;
+  mc = (move_conf *) space(sizeof(move_conf));
+  mc->perm_w = 1;
+  mc->em_alphasize = -1;
+  mc->em_length = -1;
+  return mc;
+}
+
+/* sizes of spins, permutations and trees, which the unpack functions
+   need; pack_spin(), pack_perm() and pack_tree() set them, this is for
+   keys that were stored without packing (snapshots). 0 keeps a size */
+void set_key_dims(int spin_len, int perm_n, int tree_n) {
+  if (spin_len) MC->spin_len = spin_len;
+  if (perm_n) {
+    MC->perm_n = perm_n;
+    MC->perm_w = (perm_n>128) ? 2 : 1;
+  }
+  if (tree_n) {
+    MC->tree_n  = tree_n;
+    MC->tree_nb = (tree_n+5)/7;
+  }
+}
+
+/* install mc as the move set settings of the calling thread */
+void use_move_conf(move_conf *mc) {
+  MC = mc;
+}
+
+void free_move_conf(move_conf *mc) {
+  if (mc==NULL) return;
+  free(mc->adjlist);
+  free(mc->csr_off);
+  free(mc->csr_adj);
+  free(mc->farbe);
+  free(mc->pairable);
+  free(mc->em_alphabet);
+  if (MC==mc) MC=NULL;
+  free(mc);
 }
 
 /********************************************************************/
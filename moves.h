@@ -0,0 +1,44 @@
+/* moves.h */
+/* landscape dependent settings of the built in move sets */
+
+#ifndef _moves_h
+#define _moves_h
+
+#define CS_BITS 3
+
+/* Every landscape has its own move_conf; the move set functions use
+   the one installed on the calling thread by use_move_conf(). */
+typedef struct move_conf {
+  /* Hamming graphs (String_move_it) and lattice proteins */
+  char *alphabet;
+  int alphasize;
+  short cs_move3[1<<(3*CS_BITS)]; /* 3-letter window -> new window */
+  short cs_move4[1<<(4*CS_BITS)]; /* 4-letter window -> new window */
+  short cs_end[1<<(2*CS_BITS)];   /* last 2 letters -> new letters */
+  /* spins, permutations and trees */
+  int spin_len;
+  int perm_n;                     /* length of permutations */
+  int perm_w;                     /* bytes per Lehmer digit */
+  int tree_n;                     /* number of leaves */
+  int tree_nb;                    /* bytes per split */
+  /* general graphs */
+  char *adjlist;                  /* neighbors of the last read vertex */
+  unsigned long long csr_n, *csr_off;
+  unsigned int *csr_adj;
+  /* RNA */
+  char *farbe;                    /* sequence */
+  int len;                        /* length of sequence */
+  unsigned long *pairable;        /* row i: bases j>=i+MYTURN pairing with i */
+  int nwords;                     /* words per bitset row */
+  int xtof;                       /* do shift moves */
+  int noLP;                       /* no lonely pairs move-set */
+  /* pack_em() */
+  int em_ratio;
+  char *em_alphabet;
+  int em_alphasize;
+  int em_length;
+} move_conf;
+
+extern THREADLOCAL move_conf *MC;
+
+#endif
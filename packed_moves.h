@@ -0,0 +1,192 @@
+/* packed_moves.h */
+/* neighbor generators of the move sets working on packed keys (Q2, X,
+   P and T).  They are inline so that barriers.c can build a lookup
+   kernel per move set with the emit step inlined; moves.c wraps them
+   around push() for the generic path. */
+
+#ifndef _packed_moves_h
+#define _packed_moves_h
+
+#include <string.h>
+
+/* receives each neighbor key, which is only valid during the call */
+typedef void (*key_sink)(void *ctx, const char *key);
+
+/* spins: 7 per key byte below a guard bit, see pack_spin() */
+static const unsigned char spin_mask[7] = {64,32,16,8,4,2,1};
+
+#define SPIN_FLIP(s,i) ((s)[(i)/7] ^= spin_mask[(i)%7])
+#define SPIN_UP(s,i)   ((s)[(i)/7] & spin_mask[(i)%7])
+
+/* work buffers of one configuration, set up by spin_start(),
+   perm_start() and tree_start() in moves.c for the calling thread */
+typedef struct spin_ws {
+  unsigned char *key;  /* copy of the key, changed and restored */
+  int *up, *down;      /* positions of '+' and '-' spins */
+  int n;               /* spins */
+} spin_ws;
+
+typedef struct perm_ws {
+  const unsigned char *packed;  /* the key of the permutation P */
+  unsigned char *key;           /* copy of packed, changed and restored */
+  int *P, *d;                   /* permutation and its Lehmer digits */
+  int *tail, *below;            /* for reversals */
+  int n, w;                     /* elements, bytes per digit */
+} perm_ws;
+
+typedef struct tree_ws {
+  unsigned char *set;  /* leaf set of each node, see tree_build() */
+  unsigned char *key;  /* neighbor key */
+  int *parent, *child;
+  int n, nb;           /* leaves, bytes per split */
+} tree_ws;
+
+extern spin_ws *spin_start(const char *packed);
+extern perm_ws *perm_start(const char *packed);
+extern tree_ws *tree_start(const char *packed);
+
+/* 1-point mutants */
+static inline void spin_flip_moves(spin_ws *ws, key_sink emit, void *ctx) {
+  int i;
+  for (i=0; i<ws->n; i++) {
+    SPIN_FLIP(ws->key, i);
+    emit(ctx, (char *) ws->key);
+    SPIN_FLIP(ws->key, i);
+  }
+}
+
+/* complement the spins after position k for all k */
+static inline void spin_complement_moves(spin_ws *ws, key_sink emit,
+					 void *ctx) {
+  int i;
+  for (i=ws->n-1; i>=0; i--) {
+    SPIN_FLIP(ws->key, i);
+    emit(ctx, (char *) ws->key);
+  }
+}
+
+/* exchange each '+' with each '-' */
+static inline void spin_exchange_moves(spin_ws *ws, key_sink emit,
+				       void *ctx) {
+  int i, j, nu, nd;
+  for (nu=nd=i=0; i<ws->n; i++) {
+    if (SPIN_UP(ws->key, i)) ws->up[nu++] = i;
+    else ws->down[nd++] = i;
+  }
+  for (i=0; i<nu; i++) {
+    SPIN_FLIP(ws->key, ws->up[i]);
+    for (j=0; j<nd; j++) {
+      SPIN_FLIP(ws->key, ws->down[j]);
+      emit(ctx, (char *) ws->key);
+      SPIN_FLIP(ws->key, ws->down[j]);
+    }
+    SPIN_FLIP(ws->key, ws->up[i]);
+  }
+}
+
+/* write Lehmer digit d at position k of a key with w bytes per digit */
+static inline void perm_put(unsigned char *key, int k, int d, int w) {
+  if (w==1) key[k] = 128 | d;
+  else {
+    key[2*k]   = 128 | (d>>7);
+    key[2*k+1] = 128 | (d&127);
+  }
+}
+
+/* Transposing a=P[i] and b=P[j] changes the digits of i<k<j by
+   [a<P[k]]-[b<P[k]]; b gets d[j] plus the elements of P[i+1..j-1]
+   below it plus [a<b], and a gets d[i] minus the elements of P[i+1..j]
+   below it. */
+static inline void perm_transposition_moves(perm_ws *ws, key_sink emit,
+					    void *ctx) {
+  int i, j, k, a, b, m, below_a, n=ws->n, w=ws->w;
+  int *P=ws->P, *d=ws->d;
+  for (i=0; i<n-1; i++) {
+    a = P[i];
+    for (below_a=0, j=i+1; j<n; j++) {
+      b = P[j];
+      if (b<a) below_a++;
+      for (m=0, k=i+1; k<j; k++) {
+	if (P[k]<b) m++;
+	perm_put(ws->key, k, d[k] + (a<P[k]) - (b<P[k]), w);
+      }
+      perm_put(ws->key, i, d[j] + m + (a<b), w);
+      perm_put(ws->key, j, d[i] - below_a, w);
+      emit(ctx, (char *) ws->key);
+      memcpy(ws->key+w*i, ws->packed+w*i, w*(j-i+1));  /* restore key */
+    }
+  }
+}
+
+/* transpositions of neighboring elements */
+static inline void perm_ctransposition_moves(perm_ws *ws, key_sink emit,
+					     void *ctx) {
+  int i, a, b, n=ws->n, w=ws->w;
+  for (i=0; i<n-1; i++) {
+    a = ws->P[i]; b = ws->P[i+1];
+    perm_put(ws->key, i,   ws->d[i+1] + (a<b), w);
+    perm_put(ws->key, i+1, ws->d[i] - (b<a), w);
+    emit(ctx, (char *) ws->key);
+    memcpy(ws->key+w*i, ws->packed+w*i, 2*w);          /* restore key */
+  }
+}
+
+/* Reversing P[i..j] moves P[k] to i+j-k, where its digit becomes
+   tail[k] = #{l>j: P[l]<P[k]} plus below[k] = #{i<=l<k: P[l]<P[k]}.
+   For fixed i both are kept up to date as j grows. */
+static inline void perm_reversal_moves(perm_ws *ws, key_sink emit,
+				       void *ctx) {
+  int i, j, k, v, n=ws->n, w=ws->w;
+  int *P=ws->P, *tail=ws->tail, *below=ws->below;
+  for (i=0; i<n-1; i++) {
+    tail[i] = ws->d[i];
+    below[i] = 0;
+    for (j=i+1; j<n; j++) {
+      v = P[j];
+      below[j] = 0;
+      for (k=i; k<j; k++) {
+	if (v<P[k]) tail[k]--;
+	else below[j]++;
+      }
+      tail[j] = ws->d[j];
+      for (k=i; k<=j; k++)
+	perm_put(ws->key, i+j-k, tail[k] + below[k], w);
+      emit(ctx, (char *) ws->key);
+      memcpy(ws->key+w*i, ws->packed+w*i, w*(j-i+1));  /* restore key */
+    }
+  }
+}
+
+/* Nearest neighbor interchanges: an NNI move changes exactly one
+   split, so neighbor keys are made by replacing that split in the
+   sorted list of splits of the working tree. */
+static inline void tree_nni_moves(tree_ws *ws, key_sink emit, void *ctx) {
+  int i, j, m, v, u, b, c, w, n=ws->n, k=ws->n-3, nb=ws->nb;
+  unsigned char *x, *set=ws->set, *key=ws->key;
+
+  x = set+(2*n-3)*nb;                  /* scratch for the new split */
+  for (i=0; i<k; i++) {
+    v = n-1+i;
+    u = ws->parent[v];
+    b = (ws->child[2*u]==v) ? ws->child[2*u+1] : ws->child[2*u];
+    for (w=0; w<2; w++) {
+      /* swap b with one child of v, the other child c stays with v */
+      c = ws->child[2*v+w];
+      for (j=0; j<nb; j++) x[j] = set[b*nb+j] | set[c*nb+j];
+      for (m=j=0; j<k; j++) {
+	if (j==i) continue;
+	if (memcmp(set+(n-1+j)*nb, x, nb)>0) break;
+	memcpy(key+(m++)*nb, set+(n-1+j)*nb, nb);
+      }
+      memcpy(key+(m++)*nb, x, nb);
+      for (; j<k; j++)
+	if (j!=i) memcpy(key+(m++)*nb, set+(n-1+j)*nb, nb);
+      key[m*nb] = '\0';
+      emit(ctx, (char *) key);
+    }
+  }
+}
+
+#endif
+
+/* End of file */
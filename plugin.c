@@ -0,0 +1,53 @@
+/* plugin.c */
+/* load move sets from shared objects (see barriers_plugin.h) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "utils.h"
+#include "plugin.h"
+#if HAVE_DLOPEN && HAVE_DLFCN_H
+#include <dlfcn.h>
+#endif
+
+#if HAVE_DLOPEN && HAVE_DLFCN_H
+const barriers_moveset *load_moveset_plugin(const char *path) {
+  void *handle;
+  const barriers_moveset *(*entry)(void);
+  const barriers_moveset *ms;
+
+  /* once loaded the handle is never closed, the move set is used
+     until exit */
+  handle = dlopen(path, RTLD_NOW|RTLD_LOCAL);
+  if (handle==NULL) {
+    fprintf(stderr, "can't load plugin %s: %s\n", path, dlerror());
+    return NULL;
+  }
+  *(void **) (&entry) = dlsym(handle, "barriers_moveset_entry");
+  if (entry==NULL) {
+    fprintf(stderr, "plugin %s: no barriers_moveset_entry()\n", path);
+    dlclose(handle);
+    return NULL;
+  }
+  ms = entry();
+  if (ms==NULL || ms->abi_version != BARRIERS_PLUGIN_ABI) {
+    fprintf(stderr, "plugin %s: ABI version %d, barriers needs %d\n", path,
+	    (ms) ? ms->abi_version : -1, BARRIERS_PLUGIN_ABI);
+    dlclose(handle);
+    return NULL;
+  }
+  if (ms->neighbors==NULL) {
+    fprintf(stderr, "plugin %s: no neighbors() function\n", path);
+    dlclose(handle);
+    return NULL;
+  }
+  return ms;
+}
+#else
+const barriers_moveset *load_moveset_plugin(const char *path) {
+  fprintf(stderr, "can't load plugin %s: barriers was built without"
+	  " dlopen() support\n", path);
+  return NULL;
+}
+#endif
+
+/* End of file */
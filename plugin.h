@@ -0,0 +1,12 @@
+/* plugin.h */
+
+#ifndef _plugin_h
+#define _plugin_h
+#include "barriers_plugin.h"
+
+/* load move set plugin from shared object path, NULL on failure */
+extern const barriers_moveset *load_moveset_plugin(const char *path);
+
+#endif
+
+/* End of file */
@@ -8,10 +8,25 @@
 #include"utils.h"
 #include"pair_mat.h"
 #include"stapel.h"
+#include"moves.h"
+#if HAVE_PTHREAD
+#include<pthread.h>
+#endif
 
 static char UNUSED rcsid[] = "$Id: ringlist.c,v 1.1 2001/04/05 08:00:57 ivo Exp $";
 
 #define MYTURN 4
+#define WORDBITS (8*sizeof(unsigned long))
+
+#ifdef __GNUC__
+#define CTZ(w) __builtin_ctzl(w)
+#else
+static int CTZ(unsigned long w) {
+  int c=0;
+  while (!(w&1)) { w >>= 1; c++; }
+  return c;
+}
+#endif
 
 typedef struct _rlItem{
   int nummer;    /* number of base in sequence */
@@ -23,22 +38,22 @@ typedef struct _rlItem{
   struct _rlItem *down;
 }rlItem;
 
-static char *form=NULL; /* array 4 (.)-structure */
-static char *farbe=NULL; /* array 4 sequence */
-static int len=0; /* length of sequence */
-static int poListop=0; /* polist counter = no_of_bp */
-static rlItem *rl=NULL; /* array 4 ringlist */ 
-static rlItem *wurzl=NULL; /* virtual root of ringlist-tree */
-static rlItem **poList=NULL; /* post order list of bp's */
+/* the ringlist of the current structure is per thread */
+static THREADLOCAL char *form=NULL; /* array 4 (.)-structure */
+static THREADLOCAL int poListop=0; /* polist counter = no_of_bp */
+static THREADLOCAL rlItem *rl=NULL; /* array 4 ringlist */ 
+static THREADLOCAL rlItem *wurzl=NULL; /* virtual root of ringlist-tree */
+static THREADLOCAL rlItem **poList=NULL; /* post order list of bp's */
+static THREADLOCAL unsigned long *unpaired=NULL; /* unpaired positions of current loop */
+static THREADLOCAL int rl_len=0; /* sequence length the ringlist was built for */
 
-static int xtof; /* do shift moves */
-static int noLP; /* no lonely pairs move-set */
 static void ini_or_reset_rl(char *seq,char *struc);
 
 /* public functiones */
-void RNA_init(char *seq, int xtof, int noLP);
+void RNA_init(char *seq, int shift, int nolp);
 void RNA_move_it(char *struc);
 void RNA_free_rl(void);
+void RNA_free_thread(void);
 #ifdef HARDCORE_DEBUG
 void rl_status(void);
 #endif
@@ -53,40 +68,55 @@ static void dnb(rlItem *rli);
 static void dnb_nolp(rlItem *rli);
 static void fnb(rlItem *rli);
 static void make_poList(rlItem *root);
+static void make_pairable(void);
+static void mark_loop(rlItem *stop, int on);
 
 void RNA_init(char *seq, int shift, int nolp) {
-  xtof = shift;
-  noLP = nolp;
-  farbe = seq;
+  MC->xtof = shift;
+  MC->noLP = nolp;
+  MC->farbe = strdup(seq);
+  MC->len = strlen(seq);
+/*      update_fold_params(); */
+#if HAVE_PTHREAD
+  {
+    static pthread_once_t pair_once = PTHREAD_ONCE_INIT;
+    pthread_once(&pair_once, make_pair_matrix);
+  }
+#else
+  make_pair_matrix();
+#endif
+  make_pairable();
+}
+
+static int base_code(char c) {
+  char *pos;
+  pos=strchr(Law_and_Order,c);
+  return (pos==NULL) ? 0 : pos-Law_and_Order;
 }
 /**/
 static void ini_or_reset_rl(char *seq,char *struc){
 
   int i;
-  char *pos;
 
-  len=strlen(seq);
+  if(wurzl!=NULL && rl_len!=MC->len) RNA_free_thread(); /* other landscape */
   if(wurzl==NULL){
+    rl_len = MC->len;
     form  = strdup(struc);
-    farbe = strdup(seq);
-/*      update_fold_params(); */
-    make_pair_matrix();
-    poList=(rlItem**)calloc(len,sizeof(rlItem*));
-    rl=(rlItem*)calloc(len+1,sizeof(rlItem));
+    unpaired=(unsigned long*)calloc(MC->nwords+1,sizeof(unsigned long));
+    poList=(rlItem**)calloc(MC->len,sizeof(rlItem*));
+    rl=(rlItem*)calloc(MC->len+1,sizeof(rlItem));
     wurzl=(rlItem*)calloc(1,sizeof(rlItem));
     wurzl->typ='r';
     wurzl->nummer=-1;
-    wurzl->down=&rl[len];
+    wurzl->down=&rl[MC->len];
     poList[poListop++]=wurzl;
 
-    for(i=0;i<len;i++){
+    for(i=0;i<MC->len;i++){
       rl[i].typ='u';
-      pos=strchr(Law_and_Order,seq[i]);
-      if(pos==NULL) rl[i].base=0;
-      else rl[i].base=pos-Law_and_Order;
+      rl[i].base=base_code(seq[i]);
       rl[i].nummer=i;
       rl[i].next=&rl[i+1];
-      rl[i].prev=((i==0)?&rl[len] : &rl[i-1]);
+      rl[i].prev=((i==0)?&rl[MC->len] : &rl[i-1]);
       rl[i].up=rl[i].down=NULL;
     }
     rl[i].nummer=i;
@@ -99,10 +129,11 @@ static void ini_or_reset_rl(char *seq,char *struc){
   }
   else{ /* reset ringlist */
     strcpy (form,struc);
-    for(i=0;i<len;i++){
+    for(i=0;i<MC->len;i++){
       rl[i].typ='u';
+      rl[i].base=base_code(seq[i]);
       rl[i].next=&rl[i+1];
-      rl[i].prev=((i==0)?&rl[len] : &rl[i-1]);
+      rl[i].prev=((i==0)?&rl[MC->len] : &rl[i-1]);
       rl[i].up=rl[i].down=NULL;
     }
     rl[i].next=&rl[0]; /* rl.next ist jetzt kreis */
@@ -113,14 +144,50 @@ static void ini_or_reset_rl(char *seq,char *struc){
   reset_stapel();
 }
 
-/**/
-void RNA_free_rl(void){
+/* free the ringlist of the calling thread */
+void RNA_free_thread(void){
 
   free(rl);
   free(wurzl);
-  free(farbe);
   free(form);
   free(poList);
+  free(unpaired);
+  rl=wurzl=NULL; form=NULL; poList=NULL; unpaired=NULL;
+  poListop=0;
+}
+
+/**/
+void RNA_free_rl(void){
+
+  RNA_free_thread();
+  free(MC->farbe);
+  free(MC->pairable);
+  MC->farbe=NULL; MC->pairable=NULL;
+}
+
+/* precompute for each base the set of bases it may pair with */
+static void make_pairable(void){
+
+  int i,j;
+
+  MC->nwords=(MC->len+WORDBITS-1)/WORDBITS;
+  MC->pairable=(unsigned long*)calloc(MC->len*MC->nwords+1,sizeof(unsigned long));
+  for(i=0;i<MC->len;i++)
+    for(j=i+MYTURN;j<MC->len;j++)
+      if(pair[base_code(MC->farbe[i])][base_code(MC->farbe[j])])
+        MC->pairable[i*MC->nwords+j/WORDBITS] |= 1UL<<(j%WORDBITS);
+}
+
+/* set (on=1) or clear (on=0) the unpaired positions of a loop */
+static void mark_loop(rlItem *stop, int on){
+
+  rlItem *rli;
+
+  for(rli=stop->next;rli!=stop;rli=rli->next){
+    if(rli->typ=='p') continue;
+    if(on) unpaired[rli->nummer/WORDBITS] |= 1UL<<(rli->nummer%WORDBITS);
+    else unpaired[rli->nummer/WORDBITS] = 0;
+  }
 }
 
 /**/
@@ -131,7 +198,7 @@ static void struc2tree(char *struc){
   rlItem *rli,*rlj;
 
   struc_copy=strdup(struc);
-  for(ipos=0;ipos<len;ipos++){
+  for(ipos=0;ipos<MC->len;ipos++){
     if(struc_copy[ipos]==')'){
       jpos=ipos;
       struc_copy[ipos]='.';
@@ -211,9 +278,9 @@ static void make_poList(rlItem *root){
 /* for a given tree, generate all neighbours according to the moveset */
 void RNA_move_it(char *form){
   int i;
-  ini_or_reset_rl(farbe, form);
+  ini_or_reset_rl(MC->farbe, form);
   
-  if (noLP) { /* canonic neighbours only */
+  if (MC->noLP) { /* canonic neighbours only */
     for ( i=0; i<poListop; i++) {
       inb_nolp(poList[i]);
       if ( i > 0 ) { /* virtual root should never be deleted or fliped */
@@ -226,43 +293,54 @@ void RNA_move_it(char *form){
       inb(poList[i]);
       if ( i > 0 ) { /* virtual root should never be deleted or fliped */
 	dnb(poList[i]);
-	if(xtof) fnb(poList[i]);
+	if(MC->xtof) fnb(poList[i]);
       }
     }
   }
 }
 
 /* for a given ringlist, generate all inserte moves */
+/* candidate partners of i are enumerated a word at a time as the */
+/* intersection of i's pairable row with the unpaired bases of the loop */
 static void inb(rlItem *root) {
 
   rlItem *stop,*rli,*rlj;
+  unsigned long *row,cand;
+  int w,last;
 
   stop=root->down;
+  mark_loop(stop,1);
+  last=(stop->nummer-1)/WORDBITS;
   for(rli=stop->next;rli!=stop;rli=rli->next){
     if(rli->typ=='p') continue;
-    for(rlj=rli->next;rlj!=stop;rlj=rlj->next){
-      if(rlj->nummer - rli->nummer < MYTURN) continue;
-      if(rlj->typ=='p') continue;
-      if(pair[rli->base][rlj->base]){
+    row=MC->pairable+rli->nummer*MC->nwords;
+    for(w=(rli->nummer+MYTURN)/WORDBITS;w<=last;w++){
+      for(cand=row[w]&unpaired[w];cand;cand&=cand-1){
+        rlj=&rl[w*WORDBITS+CTZ(cand)];
         close_bp(rli,rlj);
 	push(form);
         open_bp(rli);
       }
     }
   }
+  mark_loop(stop,0);
 }
 
 static void inb_nolp(rlItem *root){
 
   rlItem *stop,*rli,*rlj;
+  unsigned long *row,cand;
+  int w,last;
 
   stop=root->down;
+  mark_loop(stop,1);
+  last=(stop->nummer-1)/WORDBITS;
   for (rli=stop->next;rli!=stop;rli=rli->next) {
     if (rli->typ=='p') continue;
-    for (rlj=rli->next;rlj!=stop;rlj=rlj->next) {
-      if (rlj->nummer - rli->nummer < MYTURN) continue;
-      if (rlj->typ=='p') continue;
-      if (pair[rli->base][rlj->base]) {
+    row=MC->pairable+rli->nummer*MC->nwords;
+    for (w=(rli->nummer+MYTURN)/WORDBITS;w<=last;w++) {
+      for (cand=row[w]&unpaired[w];cand;cand&=cand-1) {
+	rlj=&rl[w*WORDBITS+CTZ(cand)];
 	if (((rli->prev==stop && rlj->next==stop) && stop->typ != 'x') ||
 	    (rli->next == rlj->prev)) {
 	  /* base pair extends helix */
@@ -284,6 +362,7 @@ static void inb_nolp(rlItem *root){
       }
     }
   }
+  mark_loop(stop,0);
 }
 
 #if 0
@@ -457,11 +536,11 @@ void rl_status(void){
 
   int i;
 
-  printf("\n%s\n%s\n",farbe,form);
-  for(i=0;i<=len;i++){
+  printf("\n%s\n%s\n",MC->farbe,form);
+  for(i=0;i<=MC->len;i++){
     printf("%2d %c %c %2d %2d %2d %2d\n",
 	   rl[i].nummer,
-           i==len?'X':farbe[i],
+           i==MC->len?'X':MC->farbe[i],
            rl[i].typ,
            rl[i].up==NULL?0:(rl[i].up)->nummer,
            rl[i].down==NULL?0:(rl[i].down)->nummer,
@@ -4,30 +4,47 @@
 #ifndef _ringlist_h
 #define _ringlist_h
 
+/* settings of the move sets, one per landscape (see moves.h) */
+typedef struct move_conf move_conf;
+extern move_conf *new_move_conf(void);
+extern void use_move_conf(move_conf *mc);
+extern void free_move_conf(move_conf *mc);
+extern void set_key_dims(int spin_len, int perm_n, int tree_n);
+
 extern void RNA_init(char *sequence, int shift, int nolp);
 extern void RNA_move_it(char *struc);
 extern void RNA_free_rl(void);
 
-extern void SPIN_move_it(char *sting);
-extern void SPIN_complement_move_it(char *string);
+extern void SPIN_move_it(char *packed);
+extern void SPIN_complement_move_it(char *packed);
 
 extern void String_move_it(char *string);
 extern void String_move_it_crankshaft(char *string);
 extern void String_set_alpha(char *alpha);
 extern void initialize_crankshaft(void);
 extern void Q_mem_cleanup(void);
+extern void free_move_buffers(void);
+extern void RNA_free_thread(void);
 
-extern void NNI_move_it(char *struc);
+extern void NNI_move_it(char *packed);
+extern char *pack_tree(const char *tree);
+extern char *unpack_tree(const char *packed);
 
-extern void Transpos_move_it(char *);
-extern void CTranspos_move_it(char *);
-extern void Reversal_move_it(char *);
+extern void Transpos_move_it(char *packed);
+extern void CTranspos_move_it(char *packed);
+extern void Reversal_move_it(char *packed);
+extern char *pack_perm(const char *perm);
+extern char *unpack_perm(const char *packed);
 
-extern void EXCH_move_it(char *);
+extern void EXCH_move_it(char *packed);
 
 extern char *pack_spin(const char *spin);
 extern char *unpack_spin(const char *packed);
 
 extern void LIST_move_it(char *);
 extern void  put_ADJLIST(char *); 
+
+extern unsigned long CSR_read(const char *fname);
+extern int CSR_neighbors(unsigned long v, const unsigned int **adj);
+extern void CSR_free(void);
 #endif
@@ -7,6 +7,7 @@
 #include "utils.h"
 #include "hash_util.h"
 #include "simple_set.h"
+#include "arena.h"
 
 
 static int comp_basinT(const void *a, const void *b) {
@@ -14,16 +15,51 @@ static int comp_basinT(const void *a, const void *b) {
   A = ((basinT *)a)->basin; B = ((basinT *)b)->basin;
   if (A!=B) return (A - B);
   if (((basinT *)a)->hp==NULL) return -1; 
-  if (((basinT *)a)->hp==NULL) return  1;
+  if (((basinT *)b)->hp==NULL) return  1;
   /* else use energy or index in file */
   return ((basinT *)a)->hp->n - ((basinT *)b)->hp->n;
 }
 
+/* empty set using its inline storage, e.g. for sets on the stack */
+void set_init(Set *set) {
+  set->num_elem = 0;
+  set->max_elem = SET_INLINE;
+  set->elem_size = sizeof(basinT);
+  set->data = set->inline_data;
+  set->arena = NULL;
+}
+
+/* release the storage of a set_init()ed set */
+void set_clear(Set *set) {
+  if (set->arena) return;  /* freed with the arena */
+  if (set->data != set->inline_data) free(set->data);
+  set_init(set);
+}
+
+/* make room for at least n elements */
+static void set_grow(Set *set, int n) {
+  if (n <= set->max_elem) return;
+  if (n < 2*set->max_elem) n = 2*set->max_elem;
+  if (set->arena) {
+    basinT *d;
+    d = arena_alloc(set->arena, sizeof(basinT)*n);
+    memcpy(d, set->data, sizeof(basinT)*set->num_elem);
+    set->data = d;
+  }
+  else if (set->data == set->inline_data) {
+    set->data = space(sizeof(basinT)*n);
+    memcpy(set->data, set->inline_data, sizeof(basinT)*set->num_elem);
+  }
+  else
+    set->data = xrealloc(set->data, sizeof(basinT)*n);
+  set->max_elem = n;
+}
+
 Set *new_set(int elems) {
   Set *set;
   set = space(sizeof(Set));
-  set->data = space(sizeof(basinT)*(elems+1));
-  set->max_elem=elems;
+  set_init(set);
+  set_grow(set, elems);
   return set;
 }
 
@@ -46,41 +82,70 @@ int set_add(Set *set, basinT *data) {
   if ((pos=set_find(set, data))>=0) return 0;
   /* else insert before -pos-1 */
   pos = -pos-1;
-  set->num_elem++;
-  if (set->max_elem <= set->num_elem) {
-    set->max_elem *= 2;
-    set->data = xrealloc(set->data, sizeof(basinT)*(set->max_elem+1));
-  }
+  set_grow(set, set->num_elem+1);
   memmove(set->data+pos+1, set->data+pos, (set->num_elem-pos)*sizeof(basinT));
   set->data[pos] = *data;
+  set->num_elem++;
   return 1;
 }
 
+/* set living in arena a; it is released by arena_reset(),
+   set_kill() must not be called on it */
+Set *new_set_arena(Arena *a) {
+  Set *set;
+  set = arena_alloc(a, sizeof(Set));
+  set_init(set);
+  set->arena = a;
+  return set;
+}
+
 void set_kill(Set *set) {
-  free(set->data);
+  set_clear(set);
   free(set);
 }
 
+/* merge s2 into s1 in place, filling s1 from the back */
 int set_merge(Set *s1, const Set *s2) {
-  int i, i1, i2, num;
-  basinT *ndata;
-  num = s1->num_elem + s2->num_elem + 1;
-  if (num<s1->max_elem) num=s1->max_elem;
-  ndata = (basinT *) space((num+1)*sizeof(basinT));
-  for (i=i1=i2=0; i1<s1->num_elem || i2<s2->num_elem; i++) {
+  int i1, i2, k, n;
+  basinT *d;
+  set_grow(s1, s1->num_elem + s2->num_elem);
+  d = s1->data;
+  i1 = s1->num_elem-1; i2 = s2->num_elem-1;
+  k = s1->num_elem + s2->num_elem;
+  while (i2>=0) {
     int c;
-    if (i1==s1->num_elem) c= +1;
-    else if (i2==s2->num_elem) c= -1;
-    else
-      c = comp_basinT(s1->data+i1, s2->data+i2);
-    ndata[i] = (c<0) ?  s1->data[i1] : s2->data[i2];
-    if (c<=0) i1++;
-    if (c>=0) i2++;
+    c = (i1<0) ? -1 : comp_basinT(d+i1, s2->data+i2);
+    if (c>0) d[--k] = d[i1--];
+    else {
+      d[--k] = s2->data[i2--];
+      if (c==0) i1--;   /* equal elements are stored once */
+    }
   }
-  free(s1->data); s1->data=ndata;
-  s1->max_elem=num; s1->num_elem=i;
-  return i;
+  /* d[0..i1] is in place; close the gap left by duplicates */
+  n = s1->num_elem + s2->num_elem - k;
+  if (k > i1+1)
+    memmove(d+i1+1, d+k, n*sizeof(basinT));
+  s1->num_elem = i1+1+n;
+  return s1->num_elem;
+}
+
+/* append n elements to set without keeping it sorted, set_sort()
+   must be called before the set is used as such */
+void set_append(Set *set, const basinT *data, int n) {
+  set_grow(set, set->num_elem + n);
+  memcpy(set->data + set->num_elem, data, n*sizeof(basinT));
+  set->num_elem += n;
+}
+
+/* sort the elements of set and store equal ones once */
+void set_sort(Set *set) {
+  int i, k;
+  basinT *d = set->data;
+  if (set->num_elem<2) return;
+  qsort(d, set->num_elem, sizeof(basinT), comp_basinT);
+  for (i=k=1; i<set->num_elem; i++)
+    if (d[i].basin!=d[k-1].basin || d[i].hp!=d[k-1].hp) d[k++] = d[i];
+  set->num_elem = k;
 }
 
-  
 /* End of file */
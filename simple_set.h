@@ -8,18 +8,27 @@ typedef struct {
   hash_entry *hp;
 } basinT;
 
+#define SET_INLINE 4  /* elements stored in the Set itself */
+
 typedef struct set {
   int num_elem;
   int max_elem;
   size_t elem_size;
-  basinT *data;
+  basinT *data;      /* inline_data, or heap storage for larger sets */
+  struct arena *arena;  /* if set, storage comes from this arena */
+  basinT inline_data[SET_INLINE];
 } Set;
 
 extern Set *new_set(int elems);
+extern Set *new_set_arena(struct arena *a);
+extern void set_init(Set *set);
+extern void set_clear(Set *set);
 extern int set_add(Set *set, basinT *data);
 extern void set_kill(Set *set);
 extern int set_merge(Set *s1, const Set *s2);
 extern int set_find(Set *set, basinT *data);
+extern void set_append(Set *set, const basinT *data, int n);
+extern void set_sort(Set *set);
 
 #endif
 /* End of file */
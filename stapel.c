@@ -9,10 +9,11 @@
 static char UNUSED rcsid[] = "$Id: stapel.c,v 1.1 2001/04/05 08:00:57 ivo Exp $";
 #define BASIS_SIZE 128
 
-static char **v=NULL;
-static int len=0;
-static int stapelTop=0;
-static int maxSize=BASIS_SIZE;
+/* one stack per thread */
+static THREADLOCAL char **v=NULL;
+static THREADLOCAL int len=0;
+static THREADLOCAL int stapelTop=0;
+static THREADLOCAL int maxSize=BASIS_SIZE;
 
 /* oeffentliche funktionen */
 void ini_stapel(int size);   /* changed pfs 03 2001 */
@@ -25,10 +26,15 @@ void free_stapel(void);
 /**/
 void ini_stapel(int size) {
   int i;
+  if (v!=NULL) {
+    if (size+1<=len) { reset_stapel(); return; } /* reuse the thread's stack */
+    free_stapel();
+  }
   len = size+1;
   v = (char**) space(BASIS_SIZE * sizeof(char*));    
   for (i=0;i<BASIS_SIZE;i++) v[i] = (char*) space(len*sizeof(char));
   stapelTop=0;
+  maxSize=BASIS_SIZE;
 }
 
 /**/
@@ -76,6 +82,8 @@ void free_stapel(void){
 
   int i;
 
+  if (v==NULL) return;
   for (i=0;i<maxSize;i++) free(v[i]);
   free(v);
+  v=NULL; len=0; stapelTop=0; maxSize=BASIS_SIZE;
 }
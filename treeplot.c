@@ -17,7 +17,7 @@ typedef struct node {
   char *label;          /* label string, if NULL use number+1             */ 
 } nodeT;
 
-static nodeT *leafs;
+static THREADLOCAL nodeT *leafs;  /* for the qsort comparisons */
 static int cmp_saddle(const void *, const void*);
 
 typedef struct link {
@@ -40,3 +40,10 @@ extern int bp_distance(const char *str1, const char *str2);
 #else
 #define UNUSED
 #endif
+
+/* per thread work buffers of the move sets (barriers --threads) */
+#if HAVE_PTHREAD && defined(__GNUC__)
+#define THREADLOCAL __thread
+#else
+#define THREADLOCAL
+#endif